@@ -0,0 +1,153 @@
+//! Benchmarks of the stages of a render
+//!
+//! Run with `cargo bench`. Some of them use "Noto Sans CJK SC" as the fallback font, which
+//! is skipped with an error message if it isn't installed.
+use criterion::{criterion_group, criterion_main, BatchSize, BenchmarkId, Criterion};
+use image::{DynamicImage, Rgba, RgbaImage};
+use silicon::blur::gaussian_blur;
+use silicon::font::FontCollection;
+use silicon::formatter::ImageFormatterBuilder;
+use silicon::utils::{init_syntect, Background, ShadowAdder};
+use syntect::easy::HighlightLines;
+use syntect::highlighting::{Style, Theme};
+use syntect::parsing::SyntaxSet;
+use syntect::util::LinesWithEndings;
+
+const SNIPPET: &str = r#"/// Read the whole file into a string
+fn read_file(path: &Path) -> Result<String, Error> {
+    let mut s = String::new();
+    File::open(path)?.read_to_string(&mut s)?;
+    Ok(s)
+}
+
+"#;
+
+/// A rust file of at least `lines` lines
+fn rust_code(lines: usize) -> String {
+    SNIPPET.repeat((lines + 6) / 7)
+}
+
+fn highlight<'a>(ps: &SyntaxSet, theme: &Theme, code: &'a str) -> Vec<Vec<(Style, &'a str)>> {
+    let syntax = ps.find_syntax_by_token("rs").unwrap();
+    let mut h = HighlightLines::new(syntax, theme);
+    LinesWithEndings::from(code)
+        .map(|line| h.highlight(line, ps))
+        .collect()
+}
+
+/// An image with something different in every pixel, like a screenshot of code
+fn noisy_image(width: u32, height: u32) -> RgbaImage {
+    RgbaImage::from_fn(width, height, |x, y| {
+        Rgba([(x * 7) as u8, (y * 3) as u8, (x ^ y) as u8, 255])
+    })
+}
+
+fn cold_start(c: &mut Criterion) {
+    let mut group = c.benchmark_group("cold_start");
+    group.sample_size(10);
+    group.bench_function("init_syntect", |b| b.iter(init_syntect));
+    group.bench_function("builtin_font", |b| {
+        b.iter(|| FontCollection::new(&[("Hack", 26.0)]).unwrap())
+    });
+    group.bench_function("system_font", |b| {
+        b.iter(|| FontCollection::new(&[("Hack", 26.0), ("Noto Sans CJK SC", 26.0)]).unwrap())
+    });
+    group.finish();
+}
+
+fn layout(c: &mut Criterion) {
+    let font = FontCollection::new(&[("Hack", 26.0), ("Noto Sans CJK SC", 26.0)]).unwrap();
+    let ascii = "let mut formatter = ImageFormatterBuilder::new().build().unwrap();";
+    let cjk = "// 读取整个文件到字符串中，并返回读取的结果。失败时返回错误。";
+
+    let mut group = c.benchmark_group("layout");
+    group.bench_function("ascii", |b| b.iter(|| font.get_text_len(ascii)));
+    group.bench_function("cjk_fallback", |b| b.iter(|| font.get_text_len(cjk)));
+    group.finish();
+}
+
+fn format(c: &mut Criterion) {
+    let (ps, ts) = init_syntect();
+    let theme = &ts.themes["Dracula"];
+    let formatter = ImageFormatterBuilder::new()
+        .font(vec![("Hack", 26.0)])
+        .shadow_adder(ShadowAdder::new().blur_radius(30.0))
+        .build()
+        .unwrap();
+
+    let mut group = c.benchmark_group("format");
+    group.sample_size(10);
+    for &lines in &[20, 500, 10_000] {
+        let code = rust_code(lines);
+        group.bench_with_input(BenchmarkId::new("highlight", lines), &code, |b, code| {
+            b.iter(|| highlight(&ps, theme, code))
+        });
+
+        let highlighted = highlight(&ps, theme, &code);
+        group.bench_with_input(
+            BenchmarkId::new("format", lines),
+            &highlighted,
+            |b, highlighted| b.iter(|| formatter.format(highlighted, theme)),
+        );
+        group.bench_with_input(
+            BenchmarkId::new("format_png", lines),
+            &highlighted,
+            |b, highlighted| {
+                b.iter(|| {
+                    formatter
+                        .format_png(highlighted, theme, Vec::new())
+                        .unwrap()
+                })
+            },
+        );
+    }
+    group.finish();
+}
+
+fn blur(c: &mut Criterion) {
+    let image = noisy_image(1200, 900);
+
+    let mut group = c.benchmark_group("gaussian_blur");
+    group.sample_size(10);
+    for &sigma in &[5.0, 30.0, 100.0] {
+        group.bench_with_input(BenchmarkId::from_parameter(sigma), &sigma, |b, &sigma| {
+            b.iter_batched(
+                || image.clone(),
+                |image| gaussian_blur(image, sigma),
+                BatchSize::LargeInput,
+            )
+        });
+    }
+    group.finish();
+}
+
+fn shadow(c: &mut Criterion) {
+    // mostly opaque, with transparent corners, like the image of the code
+    let mut code = noisy_image(1200, 900);
+    for (x, y) in &[(0, 0), (1199, 0), (0, 899), (1199, 899)] {
+        code.put_pixel(*x, *y, Rgba([0, 0, 0, 0]));
+    }
+    let code = DynamicImage::ImageRgba8(code);
+
+    let background = Background::Image(noisy_image(640, 480));
+    let adders = vec![
+        // only pasting the image
+        ("paste", ShadowAdder::new().blur_radius(0.0)),
+        ("blur_30", ShadowAdder::new().blur_radius(30.0)),
+        ("blur_100", ShadowAdder::new().blur_radius(100.0)),
+        (
+            "background_image",
+            ShadowAdder::new().background(background).blur_radius(30.0),
+        ),
+    ];
+
+    let mut group = c.benchmark_group("apply_to");
+    group.sample_size(10);
+    for (name, adder) in &adders {
+        group.bench_function(*name, |b| b.iter(|| adder.apply_to(&code)));
+    }
+    group.finish();
+}
+
+criterion_group!(benches, cold_start, layout, format, blur, shadow);
+criterion_main!(benches);
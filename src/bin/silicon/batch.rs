@@ -0,0 +1,372 @@
+//! Render many files in one process
+use crate::config::{expand_home, Config};
+use crate::{in_pool, render_cached};
+use anyhow::Error;
+use silicon::formatter::{ImageFormatter, RenderContext};
+use silicon::highlight::{highlight_parallel, highlight_range};
+use silicon::profile::Profiler;
+use std::ffi::OsString;
+use std::fs::{self, File};
+use std::io::{stdin, BufRead, BufReader, BufWriter, Read, Write};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use syntect::easy::HighlightLines;
+use syntect::highlighting::Theme;
+use syntect::parsing::{SyntaxReference, SyntaxSet};
+use syntect::util::LinesWithEndings;
+
+/// Read the `(input, output)` pairs from the manifest
+fn read_manifest(config: &Config, manifest: &Path) -> Result<Vec<(PathBuf, PathBuf)>, Error> {
+    let reader: Box<dyn Read> = if manifest == Path::new("-") {
+        Box::new(stdin())
+    } else {
+        Box::new(File::open(manifest)?)
+    };
+
+    let mut jobs = vec![];
+    for line in BufReader::new(reader).lines() {
+        let line = line?;
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+
+        let words = shell_words::split(line)?;
+        let (input, output) = match words.as_slice() {
+            [input] => (PathBuf::from(input), None),
+            [input, output] => (PathBuf::from(input), Some(PathBuf::from(output))),
+            _ => return Err(format_err!("Invalid line in manifest: {}", line)),
+        };
+
+        let output = match (output, &config.output) {
+            (Some(output), _) => output,
+            (None, Some(pattern)) => output_from_pattern(pattern, &input),
+            (None, None) => return Err(format_err!("No output for {}", input.display())),
+        };
+
+        jobs.push((input, expand_home(&output)));
+    }
+    Ok(jobs)
+}
+
+/// Whether the files given on the command line are rendered as a batch: there are
+/// several of them, or glob patterns
+pub fn is_batch(files: &[PathBuf]) -> bool {
+    files.len() > 1 || files.iter().any(|file| is_glob(file))
+}
+
+/// Whether the path is a glob pattern, rather than a file whose name has wildcards
+fn is_glob(path: &Path) -> bool {
+    let name = path.to_string_lossy();
+    (name.contains('*') || name.contains('?')) && !path.exists()
+}
+
+/// The `(input, output)` pairs of the files given on the command line, with the glob
+/// patterns expanded
+fn read_files(config: &Config) -> Result<Vec<(PathBuf, PathBuf)>, Error> {
+    let pattern = config
+        .output
+        .as_ref()
+        .filter(|pattern| {
+            let pattern = pattern.to_string_lossy();
+            pattern.contains("{stem}") || pattern.contains("{name}")
+        })
+        .ok_or_else(|| {
+            format_err!("The output must contain `{{stem}}` or `{{name}}` to render several files")
+        })?;
+
+    let mut jobs = vec![];
+    for file in &config.files {
+        let inputs = if is_glob(file) {
+            let inputs = glob(file);
+            if inputs.is_empty() {
+                return Err(format_err!("No file matches {}", file.display()));
+            }
+            inputs
+        } else {
+            vec![file.clone()]
+        };
+        jobs.extend(inputs.into_iter().map(|input| {
+            let output = expand_home(&output_from_pattern(pattern, &input));
+            (input, output)
+        }));
+    }
+    Ok(jobs)
+}
+
+/// The files matching the pattern, sorted. In a file name, `*` matches any characters and
+/// `?` any character, but not a leading dot. A `**` component matches any number of
+/// directories.
+fn glob(pattern: &Path) -> Vec<PathBuf> {
+    let mut paths = vec![PathBuf::new()];
+    for component in pattern.components() {
+        let name = component.as_os_str().to_string_lossy();
+        if name == "**" {
+            paths = paths.iter().flat_map(|dir| subdirs(dir)).collect();
+        } else if name.contains('*') || name.contains('?') {
+            paths = paths
+                .iter()
+                .flat_map(|dir| {
+                    read_dir(dir)
+                        .filter(|entry| matches(&name, &entry.to_string_lossy()))
+                        .map(move |entry| dir.join(entry))
+                })
+                .collect();
+        } else {
+            for path in &mut paths {
+                path.push(component);
+            }
+        }
+    }
+
+    paths.retain(|path| path.is_file());
+    paths.sort();
+    paths.dedup();
+    paths
+}
+
+/// The names of the entries of the directory, which is the current one if it is empty
+fn read_dir(dir: &Path) -> impl Iterator<Item = OsString> {
+    let dir = if dir.as_os_str().is_empty() {
+        Path::new(".")
+    } else {
+        dir
+    };
+    fs::read_dir(dir)
+        .into_iter()
+        .flatten()
+        .filter_map(|entry| Some(entry.ok()?.file_name()))
+}
+
+/// The directory and every directory in it, without following links
+fn subdirs(dir: &Path) -> Vec<PathBuf> {
+    let mut subdirs = vec![];
+    let mut dirs = vec![dir.to_path_buf()];
+    while let Some(dir) = dirs.pop() {
+        let dir_or_current = if dir.as_os_str().is_empty() {
+            Path::new(".")
+        } else {
+            dir.as_path()
+        };
+        if let Ok(entries) = fs::read_dir(dir_or_current) {
+            for entry in entries.filter_map(Result::ok) {
+                if entry.file_type().map_or(false, |kind| kind.is_dir()) {
+                    dirs.push(dir.join(entry.file_name()));
+                }
+            }
+        }
+        subdirs.push(dir);
+    }
+    subdirs
+}
+
+/// Whether the file name matches the pattern of `*` and `?` wildcards
+fn matches(pattern: &str, name: &str) -> bool {
+    if name.starts_with('.') && !pattern.starts_with('.') {
+        return false;
+    }
+    let (pattern, name) = (
+        pattern.chars().collect::<Vec<_>>(),
+        name.chars().collect::<Vec<_>>(),
+    );
+
+    // where to resume after the last `*`, if the characters after it don't match
+    let mut star = None;
+    let (mut p, mut n) = (0, 0);
+    while n < name.len() {
+        match pattern.get(p) {
+            Some('*') => {
+                star = Some((p + 1, n));
+                p += 1;
+            }
+            Some(&c) if c == '?' || c == name[n] => {
+                p += 1;
+                n += 1;
+            }
+            _ => match star {
+                Some((after, matched)) => {
+                    star = Some((after, matched + 1));
+                    p = after;
+                    n = matched + 1;
+                }
+                None => return false,
+            },
+        }
+    }
+    pattern[p..].iter().all(|&c| c == '*')
+}
+
+/// Replace `{stem}` and `{name}` in the pattern by the file stem and file name of the input
+fn output_from_pattern(pattern: &Path, input: &Path) -> PathBuf {
+    let stem = input.file_stem().unwrap_or_default().to_string_lossy();
+    let name = input.file_name().unwrap_or_default().to_string_lossy();
+    pattern
+        .to_string_lossy()
+        .replace("{stem}", &stem)
+        .replace("{name}", &name)
+        .into()
+}
+
+fn render_file(
+    config: &Config,
+    formatter: &ImageFormatter,
+    context: &mut RenderContext,
+    ps: &SyntaxSet,
+    theme: &Theme,
+    input: &Path,
+    output: &Path,
+) -> Result<(), Error> {
+    let (syntax, code) = config.get_source_code_from_file(ps, input)?;
+    let cache = config.get_render_cache(formatter, syntax, &code, theme, output)?;
+    render_cached(cache, output, || {
+        render_code(config, formatter, context, ps, syntax, &code, theme, output)
+    })
+}
+
+fn render_code(
+    config: &Config,
+    formatter: &ImageFormatter,
+    context: &mut RenderContext,
+    ps: &SyntaxSet,
+    syntax: &SyntaxReference,
+    code: &str,
+    theme: &Theme,
+    output: &Path,
+) -> Result<(), Error> {
+    let highlight = match config.line_window(code)? {
+        Some(window) => highlight_range(code, window, syntax, theme, ps),
+        None if config.parallel_highlight => {
+            let pool = formatter.thread_pool();
+            in_pool(pool.as_deref(), || {
+                highlight_parallel(code, syntax, theme, ps)
+            })
+        }
+        None => {
+            let mut h = HighlightLines::new(syntax, theme);
+            LinesWithEndings::from(code)
+                .map(|line| h.highlight(line, ps))
+                .collect::<Vec<_>>()
+        }
+    };
+
+    let extension = output
+        .extension()
+        .and_then(|ext| ext.to_str())
+        .map(|ext| ext.to_ascii_lowercase());
+    let is_svg = extension.as_deref() == Some("svg");
+    let error = |e| format_err!("Failed to save image to {}: {}", output.display(), e);
+
+    if is_svg || extension.as_deref() == Some("png") {
+        let file = BufWriter::new(File::create(output).map_err(|e| error(e.to_string()))?);
+        let file = if is_svg {
+            formatter.format_svg(&highlight, theme, file)
+        } else {
+            formatter.format_png_with(&highlight, theme, context, file)
+        };
+        file.and_then(|mut file| file.flush())
+            .map_err(|e| error(e.to_string()))
+    } else {
+        let image = formatter.format_with(&highlight, theme, context);
+        let result = image.save(output).map_err(|e| error(e.to_string()));
+        context.recycle(image);
+        result
+    }
+}
+
+/// Render every file of the manifest, sharing the syntaxes, the theme and the fonts.
+///
+/// The files are rendered by `config.jobs` workers, which share one formatter (and its
+/// glyph cache). Each worker keeps its own buffers for all the files it renders.
+pub fn run_batch(
+    config: &Config,
+    ps: &SyntaxSet,
+    theme: &Theme,
+    profiler: Option<&Profiler>,
+) -> Result<(), Error> {
+    let mut jobs = match &config.batch {
+        Some(manifest) => read_manifest(config, manifest)?,
+        None => vec![],
+    };
+    if !config.files.is_empty() {
+        jobs.extend(read_files(config)?);
+    }
+    let workers = match config.jobs {
+        0 => rayon::current_num_threads(),
+        n => n,
+    }
+    .min(jobs.len());
+
+    let formatter = config.get_formatter(profiler)?;
+    let next = AtomicUsize::new(0);
+    let rendered = AtomicUsize::new(0);
+
+    rayon::scope(|s| {
+        for _ in 0..workers {
+            s.spawn(|_| {
+                let mut context = RenderContext::new();
+                while let Some((input, output)) = jobs.get(next.fetch_add(1, Ordering::Relaxed)) {
+                    match render_file(config, &formatter, &mut context, ps, theme, input, output) {
+                        Ok(()) => {
+                            rendered.fetch_add(1, Ordering::Relaxed);
+                        }
+                        Err(e) => eprintln!("[error] {}: {}", input.display(), e),
+                    }
+                }
+            });
+        }
+    });
+
+    match rendered.into_inner() {
+        n if n == jobs.len() => Ok(()),
+        n => Err(format_err!("Rendered {} of {} files", n, jobs.len())),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{glob, matches};
+    use std::fs;
+    use std::path::PathBuf;
+
+    #[test]
+    fn wildcards() {
+        assert!(matches("*.rs", "main.rs"));
+        assert!(!matches("*.rs", ".rs"));
+        assert!(matches(".*", ".hidden"));
+        assert!(matches("a*b*c", "aXbYbZc"));
+        assert!(matches("m?in.*", "main.rs"));
+        assert!(matches("*", ""));
+        assert!(!matches("*.rs", "main.rs.bak"));
+        assert!(!matches("a?", "a"));
+        assert!(!matches("*.svg", "main.rs"));
+    }
+
+    #[test]
+    fn expand_glob() {
+        let dir = std::env::temp_dir().join(format!("silicon-glob-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        for file in &["a.rs", "b.txt", "src/c.rs", "src/deep/d.rs", "src/.e.rs"] {
+            let path = dir.join(file);
+            fs::create_dir_all(path.parent().unwrap()).unwrap();
+            fs::write(path, "").unwrap();
+        }
+
+        let names = |pattern: &str| {
+            glob(&dir.join(pattern))
+                .into_iter()
+                .map(|path| path.strip_prefix(&dir).unwrap().to_path_buf())
+                .collect::<Vec<_>>()
+        };
+        let paths = |names: &[&str]| names.iter().map(PathBuf::from).collect::<Vec<_>>();
+        assert_eq!(names("*.rs"), paths(&["a.rs"]));
+        assert_eq!(names("*/*.rs"), paths(&["src/c.rs"]));
+        assert_eq!(
+            names("**/*.rs"),
+            paths(&["a.rs", "src/c.rs", "src/deep/d.rs"])
+        );
+        assert_eq!(names("src/**/?.rs"), paths(&["src/c.rs", "src/deep/d.rs"]));
+        assert_eq!(names("*.png"), paths(&[]));
+
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
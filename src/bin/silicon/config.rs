@@ -1,14 +1,23 @@
+use crate::profile::{parse_profile_format, ProfileFormat};
 use anyhow::{Context, Error};
 use clipboard::{ClipboardContext, ClipboardProvider};
-use image::Rgba;
+use image::{Rgba, RgbaImage};
+use lazy_static::lazy_static;
 use silicon::directories::PROJECT_DIRS;
+use silicon::encoder::{CompressionLevel, FilterType, PngOptions};
 use silicon::formatter::{ImageFormatter, ImageFormatterBuilder};
-use silicon::utils::{Background, ShadowAdder, ToRgba};
+use silicon::profile::Profiler;
+use silicon::render_cache::{RenderCache, RenderKey};
+use silicon::utils::{load_theme_set, Background, BackgroundFit, ShadowAdder, ToRgba};
+use std::collections::HashMap;
 use std::ffi::OsString;
 use std::fs::File;
 use std::io::{stdin, Read};
 use std::num::ParseIntError;
-use std::path::PathBuf;
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+use std::time::SystemTime;
 use structopt::clap::AppSettings::ColoredHelp;
 use structopt::StructOpt;
 use syntect::highlighting::{Theme, ThemeSet};
@@ -43,6 +52,65 @@ fn parse_str_color(s: &str) -> Result<Rgba<u8>, Error> {
         .map_err(|_| format_err!("Invalid color: `{}`", s))?)
 }
 
+fn parse_background_fit(s: &str) -> Result<BackgroundFit, Error> {
+    Ok(match s {
+        "stretch" => BackgroundFit::Stretch,
+        "cover" => BackgroundFit::Cover,
+        "tile" => BackgroundFit::Tile,
+        _ => return Err(format_err!("Invalid background fit: `{}`", s)),
+    })
+}
+
+/// Max number of decoded background images kept in memory
+const MAX_BACKGROUND_IMAGES: usize = 8;
+
+lazy_static! {
+    /// decoded background images, by path and modification time
+    static ref BACKGROUND_IMAGES: Mutex<HashMap<(PathBuf, Option<SystemTime>), RgbaImage>> =
+        Mutex::new(HashMap::new());
+}
+
+/// Decode the background image, or get it from the images decoded before by this process
+fn load_background_image(path: &Path) -> Result<RgbaImage, Error> {
+    let modified = std::fs::metadata(path).and_then(|m| m.modified()).ok();
+    let key = (path.to_owned(), modified);
+    if let Some(image) = BACKGROUND_IMAGES.lock().unwrap().get(&key) {
+        return Ok(image.clone());
+    }
+
+    let image = image::open(path)?.to_rgba8();
+    let mut images = BACKGROUND_IMAGES.lock().unwrap();
+    if images.len() >= MAX_BACKGROUND_IMAGES {
+        images.clear();
+    }
+    images.insert(key, image.clone());
+    Ok(image)
+}
+
+fn parse_png_compression(s: &str) -> Result<CompressionLevel, Error> {
+    Ok(match s {
+        "fast" => CompressionLevel::Fast,
+        "default" => CompressionLevel::Default,
+        "best" => CompressionLevel::Best,
+        _ => match s.parse::<u32>() {
+            Ok(level) if level <= 9 => CompressionLevel::Level(level),
+            _ => return Err(format_err!("Invalid compression level: `{}`", s)),
+        },
+    })
+}
+
+fn parse_png_filter(s: &str) -> Result<FilterType, Error> {
+    Ok(match s {
+        "none" => FilterType::NoFilter,
+        "sub" => FilterType::Sub,
+        "up" => FilterType::Up,
+        "avg" => FilterType::Avg,
+        "paeth" => FilterType::Paeth,
+        "adaptive" => FilterType::Adaptive,
+        _ => return Err(format_err!("Invalid filter: `{}`", s)),
+    })
+}
+
 fn parse_font_str(s: &str) -> Vec<(String, f32)> {
     let mut result = vec![];
     for font in s.split(';') {
@@ -75,11 +143,23 @@ fn parse_line_range(s: &str) -> Result<Vec<u32>, ParseIntError> {
     Ok(result)
 }
 
+/// Parse `START:END`, the numbers of the first and the last lines
+fn parse_line_window(s: &str) -> Result<(usize, usize), Error> {
+    let lines = s
+        .splitn(2, ':')
+        .map(|n| n.parse::<usize>())
+        .collect::<Result<Vec<_>, _>>();
+    match lines.as_deref() {
+        Ok(&[start, end]) if start >= 1 && start <= end => Ok((start, end)),
+        _ => Err(format_err!("Invalid range of lines: `{}`", s)),
+    }
+}
+
 // https://github.com/TeXitoi/structopt/blob/master/CHANGELOG.md#support-optional-vectors-of-arguments-for-distinguishing-between--o-1-2--o-and-no-option-provided-at-all-by-sphynx-180
 type FontList = Vec<(String, f32)>;
 type Lines = Vec<u32>;
 
-#[derive(StructOpt, Debug)]
+#[derive(StructOpt, Clone, Debug)]
 #[structopt(name = "silicon")]
 #[structopt(global_setting(ColoredHelp))]
 pub struct Config {
@@ -87,6 +167,21 @@ pub struct Config {
     #[structopt(long, value_name = "IMAGE", conflicts_with = "background")]
     pub background_image: Option<PathBuf>,
 
+    /// How the background image fills the image: stretch, cover (scaled and cropped) or tile
+    #[structopt(
+        long,
+        value_name = "FIT",
+        default_value = "stretch",
+        parse(try_from_str = parse_background_fit)
+    )]
+    pub background_fit: BackgroundFit,
+
+    /// Render every file listed in the manifest (or stdin if it is `-`). Each line is a file to read
+    /// and optionally where to write its image, otherwise `--output` is used as a pattern in which
+    /// `{stem}` and `{name}` are replaced by the file stem and file name.
+    #[structopt(long, value_name = "MANIFEST", parse(from_os_str))]
+    pub batch: Option<PathBuf>,
+
     /// Background color of the image
     #[structopt(
         long,
@@ -105,9 +200,10 @@ pub struct Config {
     #[structopt(long)]
     pub from_clipboard: bool,
 
-    /// File to read. If not set, stdin will be use.
+    /// Files to read. If not set, stdin will be use. Several files, or glob patterns such as
+    /// 'src/**/*.rs', are rendered like with `--batch`.
     #[structopt(value_name = "FILE", parse(from_os_str))]
-    pub file: Option<PathBuf>,
+    pub files: Vec<PathBuf>,
 
     /// The fallback font list. eg. 'Hack; SimSun=31'
     #[structopt(long, short, value_name = "FONT", parse(from_str = parse_font_str))]
@@ -121,6 +217,11 @@ pub struct Config {
     #[structopt(short, value_name = "LANG", long)]
     pub language: Option<String>,
 
+    /// Only render the lines START to END of the code, eg. `12000:12040`. The line numbers
+    /// start from START (plus `--line-offset` - 1)
+    #[structopt(long, value_name = "START:END", parse(try_from_str = parse_line_window))]
+    pub lines: Option<(usize, usize)>,
+
     /// Pad between lines
     #[structopt(long, value_name = "PAD", default_value = "2")]
     pub line_pad: u32,
@@ -129,6 +230,10 @@ pub struct Config {
     #[structopt(long, value_name = "OFFSET", default_value = "1")]
     pub line_offset: u32,
 
+    /// Number of files rendered at the same time in batch mode. (set it to 0 to use all cores)
+    #[structopt(long, short, value_name = "N", default_value = "0")]
+    pub jobs: usize,
+
     /// List all themes.
     #[structopt(long)]
     pub list_themes: bool,
@@ -137,12 +242,13 @@ pub struct Config {
     #[structopt(long)]
     pub list_fonts: bool,
 
-    /// Write output image to specific location instead of cwd.
+    /// Write output image to specific location instead of cwd. An `.svg` output is written as a
+    /// vector image.
     #[structopt(
         short,
         long,
         value_name = "PATH",
-        required_unless_one = &["config-file", "list-fonts", "list-themes", "to-clipboard"]
+        required_unless_one = &["batch", "config-file", "list-fonts", "list-themes", "serve", "to-clipboard"]
     )]
     pub output: Option<PathBuf>,
 
@@ -166,6 +272,56 @@ pub struct Config {
     #[structopt(long, value_name = "PAD", default_value = "100")]
     pub pad_vert: u32,
 
+    /// Highlight large files on several threads, splitting them at the lines which seem to
+    /// start at the top level
+    #[structopt(long)]
+    pub parallel_highlight: bool,
+
+    /// Compression level of PNG images: fast, default, best or 0-9
+    #[structopt(
+        long,
+        value_name = "LEVEL",
+        default_value = "default",
+        parse(try_from_str = parse_png_compression)
+    )]
+    pub png_compression: CompressionLevel,
+
+    /// Filter of the rows of PNG images: none, sub, up, avg, paeth or adaptive (smaller but slower)
+    #[structopt(
+        long,
+        value_name = "FILTER",
+        default_value = "sub",
+        parse(try_from_str = parse_png_filter)
+    )]
+    pub png_filter: FilterType,
+
+    /// Write PNG images with a palette when they have at most 256 colors
+    #[structopt(long)]
+    pub png_palette: bool,
+
+    /// Print the time spent in each stage to stderr, as text, json or chrome (the trace event
+    /// format of chrome://tracing). The memory allocated is only counted when silicon is built
+    /// with the `profile-alloc` feature
+    #[structopt(long, value_name = "FORMAT", parse(try_from_str = parse_profile_format))]
+    pub profile: Option<ProfileFormat>,
+
+    /// Max number of connections waiting for a worker in server mode
+    #[structopt(long, value_name = "N", default_value = "64")]
+    pub queue_size: usize,
+
+    /// Reuse the image rendered before from the same code with the same options
+    #[structopt(long)]
+    pub render_cache: bool,
+
+    /// Max size of the render cache, in MB
+    #[structopt(long, value_name = "MB", default_value = "256")]
+    pub render_cache_size: u64,
+
+    /// Serve render requests on the unix socket, keeping syntaxes, themes and fonts loaded.
+    /// Requests are handled by `--jobs` workers.
+    #[structopt(long, value_name = "SOCKET", parse(from_os_str))]
+    pub serve: Option<PathBuf>,
+
     /// Color of shadow
     #[structopt(
         long,
@@ -191,6 +347,10 @@ pub struct Config {
     #[structopt(long, value_name = "WIDTH", default_value = "4")]
     pub tab_width: u8,
 
+    /// Number of threads used to draw and compress the image. (set it to 0 to use all cores)
+    #[structopt(long, value_name = "N", default_value = "1")]
+    pub threads: usize,
+
     /// The syntax highlight theme. It can be a theme name or path to a .tmTheme file.
     #[structopt(long, value_name = "THEME", default_value = "Dracula")]
     pub theme: String,
@@ -228,17 +388,8 @@ impl Config {
             return Ok((language, code));
         }
 
-        if let Some(path) = &self.file {
-            let mut s = String::new();
-            let mut file = File::open(path)?;
-            file.read_to_string(&mut s)?;
-
-            let language = possible_language.unwrap_or_else(|| {
-                ps.find_syntax_for_file(path)?
-                    .ok_or_else(|| format_err!("Failed to detect the language"))
-            })?;
-
-            return Ok((language, s));
+        if let Some(path) = self.files.first() {
+            return self.get_source_code_from_file(ps, path);
         }
 
         let mut stdin = stdin();
@@ -253,6 +404,74 @@ impl Config {
         Ok((language, s))
     }
 
+    pub fn get_source_code_from_file<'a>(
+        &self,
+        ps: &'a SyntaxSet,
+        path: &Path,
+    ) -> Result<(&'a SyntaxReference, String), Error> {
+        let mut s = String::new();
+        let mut file = File::open(path)?;
+        file.read_to_string(&mut s)?;
+
+        let language = match &self.language {
+            Some(language) => ps
+                .find_syntax_by_token(language)
+                .ok_or_else(|| format_err!("Unsupported language: {}", language))?,
+            None => ps
+                .find_syntax_for_file(path)?
+                .ok_or_else(|| format_err!("Failed to detect the language"))?,
+        };
+
+        Ok((language, s))
+    }
+
+    /// The range of lines given by `--lines`, counted from 0
+    pub fn line_window(&self, code: &str) -> Result<Option<Range<usize>>, Error> {
+        match self.lines {
+            Some((start, _)) if code.lines().nth(start - 1).is_none() => {
+                Err(format_err!("The code has less than {} lines", start))
+            }
+            Some((start, end)) => Ok(Some(start - 1..end)),
+            None => Ok(None),
+        }
+    }
+
+    /// The options which change the image drawn from a code, other than the theme and the
+    /// language. A formatter built from a config only depends on them and on `threads`.
+    pub fn image_options(&self) -> String {
+        format!(
+            "{:?}",
+            (
+                (&self.background_image, self.background_fit, self.background),
+                (&self.font, &self.highlight_lines, self.lines),
+                (self.line_pad, self.line_offset, self.tab_width),
+                (
+                    self.no_window_controls,
+                    self.no_line_number,
+                    self.no_round_corner
+                ),
+                (self.pad_horiz, self.pad_vert),
+                (self.png_compression, self.png_filter, self.png_palette),
+                (
+                    self.shadow_color,
+                    self.shadow_blur_radius,
+                    self.shadow_offset_x,
+                    self.shadow_offset_y
+                ),
+            )
+        )
+    }
+
+    /// Load the theme, without loading the whole ThemeSet if it is a file
+    pub fn load_theme(&self) -> Result<Theme, Error> {
+        if Path::new(&self.theme).is_file() {
+            ThemeSet::get_theme(&self.theme)
+                .context(format!("Canot load the theme: {}", self.theme))
+        } else {
+            self.theme(&load_theme_set())
+        }
+    }
+
     pub fn theme(&self, ts: &ThemeSet) -> Result<Theme, Error> {
         if let Some(theme) = ts.themes.get(&self.theme) {
             Ok(theme.clone())
@@ -262,8 +481,8 @@ impl Config {
         }
     }
 
-    pub fn get_formatter(&self) -> Result<ImageFormatter, Error> {
-        let formatter = ImageFormatterBuilder::new()
+    pub fn get_formatter(&self, profiler: Option<&Profiler>) -> Result<ImageFormatter, Error> {
+        let mut formatter = ImageFormatterBuilder::new()
             .line_pad(self.line_pad)
             .window_controls(!self.no_window_controls)
             .line_number(!self.no_line_number)
@@ -273,7 +492,12 @@ impl Config {
             .shadow_adder(self.get_shadow_adder()?)
             .tab_width(self.tab_width)
             .highlight_lines(self.highlight_lines.clone().unwrap_or_default())
-            .line_offset(self.line_offset);
+            .line_offset(self.line_offset + self.lines.map_or(0, |(start, _)| start as u32 - 1))
+            .threads(self.threads)
+            .png_options(self.get_png_options());
+        if let Some(profiler) = profiler {
+            formatter = formatter.profiler(profiler.clone());
+        }
 
         Ok(formatter.build()?)
     }
@@ -281,9 +505,10 @@ impl Config {
     pub fn get_shadow_adder(&self) -> Result<ShadowAdder, Error> {
         Ok(ShadowAdder::new()
             .background(match &self.background_image {
-                Some(path) => Background::Image(image::open(path)?.to_rgba8()),
+                Some(path) => Background::Image(load_background_image(path)?),
                 None => Background::Solid(self.background),
             })
+            .background_fit(self.background_fit)
             .shadow_color(self.shadow_color)
             .blur_radius(self.shadow_blur_radius)
             .pad_horiz(self.pad_horiz)
@@ -292,15 +517,65 @@ impl Config {
             .offset_y(self.shadow_offset_y))
     }
 
+    pub fn get_png_options(&self) -> PngOptions {
+        PngOptions {
+            compression: self.png_compression,
+            filter: self.png_filter,
+            palette: self.png_palette,
+            threads: self.threads,
+        }
+    }
+
+    /// The render cache and the key of the image rendered from the code, if the cache is enabled
+    pub fn get_render_cache(
+        &self,
+        formatter: &ImageFormatter,
+        syntax: &SyntaxReference,
+        code: &str,
+        theme: &Theme,
+        output: &Path,
+    ) -> Result<Option<(RenderCache, RenderKey)>, Error> {
+        if !self.render_cache {
+            return Ok(None);
+        }
+
+        let extension = output
+            .extension()
+            .map(|ext| ext.to_string_lossy().to_lowercase());
+        let mut key = RenderKey::new()
+            .add(env!("CARGO_PKG_VERSION"))
+            .add(&self.image_options())
+            .add(&syntax.name)
+            .add(code)
+            .add(&format!("{:?}", theme))
+            .add(&extension);
+        // a font or a background image may be replaced by another one with the same name
+        for path in formatter.font_files() {
+            let modified = std::fs::metadata(path).and_then(|metadata| metadata.modified());
+            key = key.add(path).add(&modified.ok());
+        }
+        if let Some(path) = &self.background_image {
+            key = key.add(&std::fs::read(path)?);
+        }
+
+        let cache = RenderCache::new(
+            RenderCache::default_dir(),
+            self.render_cache_size * 1024 * 1024,
+        );
+        Ok(Some((cache, key)))
+    }
+
     pub fn get_expanded_output(&self) -> Option<PathBuf> {
-        let need_expand = self.output.as_ref().map(|p| p.starts_with("~")) == Some(true);
+        self.output.as_deref().map(expand_home)
+    }
+}
 
-        if let (Ok(home_dir), true) = (std::env::var("HOME"), need_expand) {
-            self.output
-                .as_ref()
-                .map(|p| p.to_string_lossy().replacen("~", &home_dir, 1).into())
-        } else {
-            self.output.clone()
+/// Expand the leading `~` of the path
+pub fn expand_home(path: &Path) -> PathBuf {
+    match std::env::var("HOME") {
+        Ok(home_dir) if path.starts_with("~") => {
+            path.to_string_lossy().replacen("~", &home_dir, 1).into()
         }
+        _ => path.to_owned(),
     }
 }
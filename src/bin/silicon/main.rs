@@ -1,8 +1,19 @@
 #[macro_use]
 extern crate anyhow;
+#[cfg(target_os = "macos")]
+#[macro_use]
+extern crate objc;
+
+// NSPasteboard is in AppKit
+#[cfg(target_os = "macos")]
+#[link(name = "AppKit", kind = "framework")]
+extern "C" {}
 
 use anyhow::Error;
 use image::DynamicImage;
+use rayon::ThreadPool;
+#[cfg(target_os = "macos")]
+use silicon::encoder::encode_png;
 use structopt::StructOpt;
 use syntect::easy::HighlightLines;
 use syntect::util::LinesWithEndings;
@@ -11,45 +22,110 @@ use {
     clipboard_win::{formats, Clipboard, Setter},
     image::ImageOutputFormat,
 };
-#[cfg(target_os = "macos")]
-use {image::ImageOutputFormat, pasteboard::Pasteboard};
 #[cfg(target_os = "linux")]
-use {image::ImageOutputFormat, std::process::Command};
+use {
+    silicon::encoder::encode_png,
+    std::process::{Command, Stdio},
+};
 
+mod batch;
 mod config;
+mod profile;
+#[cfg(unix)]
+mod serve;
+use crate::batch::{is_batch, run_batch};
 use crate::config::{config_file, get_args_from_config_file};
+use crate::profile::Recorder;
 use config::Config;
-use silicon::utils::init_syntect;
+use silicon::encoder::PngOptions;
+use silicon::highlight::{highlight_parallel, highlight_range};
+#[cfg(feature = "profile-alloc")]
+use silicon::profile::CountingAllocator;
+use silicon::profile::{time, Profiler};
+use silicon::render_cache::{RenderCache, RenderKey};
+use silicon::utils::{load_syntax_set, load_theme_set};
+use std::fs::{self, File};
+use std::io::{BufWriter, Write};
+use std::path::Path;
+use std::sync::mpsc::{sync_channel, Receiver};
+use std::sync::Arc;
+use std::thread::{self, JoinHandle};
+use syntect::highlighting::{Style, Theme};
+use syntect::parsing::{SyntaxReference, SyntaxSet};
+
+/// Max number of highlighted lines waiting to be laid out
+const LINE_QUEUE_SIZE: usize = 256;
+
+/// Count the allocated bytes for `--profile`
+#[cfg(feature = "profile-alloc")]
+#[global_allocator]
+static ALLOCATOR: CountingAllocator = CountingAllocator;
 
 #[cfg(target_os = "linux")]
-pub fn dump_image_to_clipboard(image: &DynamicImage) -> Result<(), Error> {
-    let mut temp = tempfile::NamedTempFile::new()?;
-    image.write_to(&mut temp, ImageOutputFormat::Png)?;
-    Command::new("xclip")
-        .args(&[
-            "-sel",
-            "clip",
-            "-t",
-            "image/png",
-            temp.path().to_str().unwrap(),
-        ])
-        .status()
-        .map_err(|e| format_err!("Failed to copy image to clipboard: {}", e))?;
+pub fn dump_image_to_clipboard(image: &DynamicImage, options: &PngOptions) -> Result<(), Error> {
+    let png = encode_png(image.as_rgba8().unwrap(), vec![], options)?;
+
+    // pipe the image to the clipboard tool, which keeps serving it after silicon exits.
+    // XWayland may be running without wl-copy installed.
+    let xclip = || {
+        let mut command = Command::new("xclip");
+        command.args(&["-sel", "clip", "-t", "image/png"]);
+        command.stdin(Stdio::piped()).spawn()
+    };
+    let child = if std::env::var_os("WAYLAND_DISPLAY").is_some() {
+        match Command::new("wl-copy")
+            .args(&["--type", "image/png"])
+            .stdin(Stdio::piped())
+            .spawn()
+        {
+            Err(e) if e.kind() == std::io::ErrorKind::NotFound => xclip(),
+            child => child,
+        }
+    } else {
+        xclip()
+    };
+    let mut child = child.map_err(|e| format_err!("Failed to copy image to clipboard: {}", e))?;
+
+    // close stdin after writing so that the tool stops reading
+    let written = child.stdin.take().unwrap().write_all(&png);
+    let status = child.wait()?;
+    written.map_err(|e| format_err!("Failed to copy image to clipboard: {}", e))?;
+    if !status.success() {
+        return Err(format_err!("Failed to copy image to clipboard: {}", status));
+    }
     Ok(())
 }
 
 #[cfg(target_os = "macos")]
-pub fn dump_image_to_clipboard(image: &DynamicImage) -> Result<(), Error> {
-    let mut temp = tempfile::NamedTempFile::new()?;
-    image.write_to(&mut temp, ImageOutputFormat::Png)?;
-    unsafe {
-        Pasteboard::Image.copy(temp.path().to_str().unwrap());
+pub fn dump_image_to_clipboard(image: &DynamicImage, options: &PngOptions) -> Result<(), Error> {
+    use objc::runtime::{Object, BOOL, NO};
+
+    let png = encode_png(image.as_rgba8().unwrap(), vec![], options)?;
+
+    let copied = unsafe {
+        let pool: *mut Object = msg_send![class!(NSAutoreleasePool), new];
+
+        let pasteboard: *mut Object = msg_send![class!(NSPasteboard), generalPasteboard];
+        let _: isize = msg_send![pasteboard, clearContents];
+
+        let data: *mut Object =
+            msg_send![class!(NSData), dataWithBytes: png.as_ptr() length: png.len()];
+        let kind: *mut Object =
+            msg_send![class!(NSString), stringWithUTF8String: b"public.png\0".as_ptr()];
+        let copied: BOOL = msg_send![pasteboard, setData: data forType: kind];
+
+        let _: () = msg_send![pool, drain];
+        copied
+    };
+
+    if copied == NO {
+        return Err(format_err!("Failed to copy image to clipboard"));
     }
     Ok(())
 }
 
 #[cfg(target_os = "windows")]
-pub fn dump_image_to_clipboard(image: &DynamicImage) -> Result<(), Error> {
+pub fn dump_image_to_clipboard(image: &DynamicImage, _options: &PngOptions) -> Result<(), Error> {
     let mut temp: Vec<u8> = Vec::new();
 
     // Convert the image to RGB without alpha because the clipboard
@@ -68,12 +144,124 @@ pub fn dump_image_to_clipboard(image: &DynamicImage) -> Result<(), Error> {
 }
 
 #[cfg(not(any(target_os = "linux", target_os = "macos", target_os = "windows")))]
-pub fn dump_image_to_clipboard(_image: &DynamicImage) -> Result<(), Error> {
+pub fn dump_image_to_clipboard(_image: &DynamicImage, _options: &PngOptions) -> Result<(), Error> {
     Err(format_err!(
         "This feature hasn't been implemented for your system"
     ))
 }
 
+/// The highlighted lines sent by the highlighting thread
+type Lines = Receiver<Vec<(Style, String)>>;
+
+/// Highlight the code on another thread, while `format` lays out the lines already
+/// highlighted, so that the tokens of the whole code are never kept in memory, unless the
+/// code is highlighted in parallel.
+fn format_streaming<F, R>(
+    ps: SyntaxSet,
+    syntax: usize,
+    code: String,
+    theme: &Theme,
+    config: &Config,
+    pool: Option<Arc<ThreadPool>>,
+    profiler: Option<&Profiler>,
+    format: F,
+) -> Result<R, Error>
+where
+    F: FnOnce(Lines) -> R,
+{
+    let (sender, receiver) = sync_channel(LINE_QUEUE_SIZE);
+    let window = config.line_window(&code)?;
+    let parallel = config.parallel_highlight;
+
+    let highlighter = {
+        let theme = theme.clone();
+        let profiler = profiler.cloned();
+        thread::spawn(move || {
+            // includes waiting for the lines to be laid out when the queue is full
+            time(profiler.as_ref(), "highlight", || {
+                let syntax = &ps.syntaxes()[syntax];
+                let mut h = HighlightLines::new(syntax, &theme);
+                let lines: Box<dyn Iterator<Item = Vec<(Style, &str)>> + '_> = match window {
+                    Some(window) => {
+                        Box::new(highlight_range(&code, window, syntax, &theme, &ps).into_iter())
+                    }
+                    // the lines are only sent once they are all highlighted
+                    None if parallel => {
+                        let lines = in_pool(pool.as_deref(), || {
+                            highlight_parallel(&code, syntax, &theme, &ps)
+                        });
+                        Box::new(lines.into_iter())
+                    }
+                    None => {
+                        Box::new(LinesWithEndings::from(&code).map(|line| h.highlight(line, &ps)))
+                    }
+                };
+
+                for tokens in lines {
+                    let tokens = tokens
+                        .into_iter()
+                        .map(|(style, text)| (style, text.to_owned()))
+                        .collect::<Vec<_>>();
+                    if sender.send(tokens).is_err() {
+                        return;
+                    }
+                }
+            })
+        })
+    };
+
+    let result = format(receiver);
+
+    highlighter
+        .join()
+        .map_err(|_| format_err!("Failed to highlight the code"))?;
+    Ok(result)
+}
+
+/// Run `f` on the pool, or on the current one if there is none
+pub fn in_pool<R: Send>(pool: Option<&ThreadPool>, f: impl FnOnce() -> R + Send) -> R {
+    match pool {
+        Some(pool) => pool.install(f),
+        None => f(),
+    }
+}
+
+/// Write the image cached for the key to `output`, otherwise render it with `render` and
+/// add it to the cache
+pub fn render_cached<F>(
+    cache: Option<(RenderCache, RenderKey)>,
+    output: &Path,
+    render: F,
+) -> Result<(), Error>
+where
+    F: FnOnce() -> Result<(), Error>,
+{
+    let (cache, key) = match cache {
+        Some(cache) => cache,
+        None => return render(),
+    };
+
+    if let Some(data) = cache.get(&key) {
+        return fs::write(output, data)
+            .map_err(|e| format_err!("Failed to save image to {}: {}", output.display(), e));
+    }
+
+    render()?;
+    // the image is saved anyway, so it's not an error if it isn't cached
+    if let Err(e) = fs::read(output).and_then(|data| cache.put(&key, &data)) {
+        eprintln!("[warning] Failed to update the render cache: {}", e);
+    }
+    Ok(())
+}
+
+/// Index of the syntax in the set, so that the set can be moved to the highlighting thread
+fn syntax_index(ps: &SyntaxSet, syntax: &SyntaxReference) -> usize {
+    ps.syntaxes()
+        .iter()
+        .position(|s| std::ptr::eq(s, syntax))
+        .unwrap()
+}
+
 fn run() -> Result<(), Error> {
     let mut args = get_args_from_config_file();
     let mut args_cli = std::env::args_os();
@@ -81,10 +269,8 @@ fn run() -> Result<(), Error> {
     args.extend(args_cli);
     let config: Config = Config::from_iter(args);
 
-    let (ps, ts) = init_syntect();
-
     if config.list_themes {
-        for i in ts.themes.keys() {
+        for i in load_theme_set().themes.keys() {
             println!("{}", i);
         }
         return Ok(());
@@ -99,26 +285,97 @@ fn run() -> Result<(), Error> {
         return Ok(());
     }
 
-    let (syntax, code) = config.get_source_code(&ps)?;
+    let recorder = config.profile.map(|_| {
+        #[cfg(feature = "profile-alloc")]
+        CountingAllocator::enable();
+        Recorder::new()
+    });
+    let result = render(&config, recorder.as_ref().map(Recorder::profiler));
+    if let (Some(recorder), Some(format)) = (&recorder, config.profile) {
+        eprint!("{}", recorder.report(format));
+    }
+    result
+}
+
+fn render(config: &Config, profiler: Option<Profiler>) -> Result<(), Error> {
+    let profiler = profiler.as_ref();
+
+    // syntaxes take the longest to load, so load them while loading the theme and the fonts
+    let ps = {
+        let profiler = profiler.cloned();
+        thread::spawn(move || time(profiler.as_ref(), "load_syntaxes", load_syntax_set))
+    };
+    let join = |ps: JoinHandle<SyntaxSet>| {
+        ps.join()
+            .map_err(|_| format_err!("Failed to load syntaxes"))
+    };
+
+    if let Some(path) = &config.serve {
+        #[cfg(unix)]
+        return serve::serve(config, path, join(ps)?, load_theme_set());
+        #[cfg(not(unix))]
+        return Err(format_err!(
+            "Server mode is only supported on unix: {}",
+            path.display()
+        ));
+    }
 
-    let theme = config.theme(&ts)?;
+    let theme = time(profiler, "load_theme", || config.load_theme())?;
 
-    let mut h = HighlightLines::new(syntax, &theme);
-    let highlight = LinesWithEndings::from(&code)
-        .map(|line| h.highlight(line, &ps))
-        .collect::<Vec<_>>();
+    if config.batch.is_some() || is_batch(&config.files) {
+        return run_batch(config, &join(ps)?, &theme, profiler);
+    }
 
-    let mut formatter = config.get_formatter()?;
+    let formatter = config.get_formatter(profiler)?;
+    // the code is highlighted in parallel with the threads which draw it
+    let pool = formatter.thread_pool();
 
-    let image = formatter.format(&highlight, &theme);
+    let ps = join(ps)?;
+    let (syntax, code) = time(profiler, "read_code", || config.get_source_code(&ps))?;
 
     if config.to_clipboard {
-        dump_image_to_clipboard(&image)?;
+        let syntax = syntax_index(&ps, syntax);
+        let image = format_streaming(ps, syntax, code, &theme, config, pool, profiler, |lines| {
+            formatter.format_lines(lines, &theme)
+        })?;
+        time(profiler, "clipboard", || {
+            dump_image_to_clipboard(&image, &config.get_png_options())
+        })?;
     } else {
         let path = config.get_expanded_output().unwrap();
-        image
-            .save(&path)
-            .map_err(|e| format_err!("Failed to save image to {}: {}", path.display(), e))?;
+        let cache = config.get_render_cache(&formatter, syntax, &code, &theme, &path)?;
+        let syntax = syntax_index(&ps, syntax);
+        let extension = path
+            .extension()
+            .and_then(|ext| ext.to_str())
+            .map(|ext| ext.to_ascii_lowercase());
+        let is_svg = extension.as_deref() == Some("svg");
+
+        render_cached(cache, &path, || {
+            if is_svg || extension.as_deref() == Some("png") {
+                // encode the image while drawing it, without keeping the whole image
+                let file = File::create(&path).map_err(|e| {
+                    format_err!("Failed to save image to {}: {}", path.display(), e)
+                })?;
+                format_streaming(ps, syntax, code, &theme, config, pool, profiler, |lines| {
+                    let file = BufWriter::new(file);
+                    if is_svg {
+                        formatter.format_svg(lines, &theme, file)
+                    } else {
+                        formatter.format_png(lines, &theme, file)
+                    }
+                })?
+                .and_then(|mut file| file.flush())
+                .map_err(|e| format_err!("Failed to save image to {}: {}", path.display(), e))
+            } else {
+                let image =
+                    format_streaming(ps, syntax, code, &theme, config, pool, profiler, |lines| {
+                        formatter.format_lines(lines, &theme)
+                    })?;
+                time(profiler, "encode", || image.save(&path))
+                    .map_err(|e| format_err!("Failed to save image to {}: {}", path.display(), e))
+            }
+        })?;
     }
 
     Ok(())
@@ -0,0 +1,121 @@
+//! Print the time spent in each stage, for `--profile`
+use anyhow::Error;
+use silicon::profile::{Profiler, Span};
+use std::sync::{Arc, Mutex};
+use std::time::Instant;
+
+#[derive(Copy, Clone, Debug)]
+pub enum ProfileFormat {
+    /// a table of the total of each stage
+    Text,
+    /// every span, as a JSON array
+    Json,
+    /// every span, in the trace event format of `chrome://tracing`
+    Chrome,
+}
+
+pub fn parse_profile_format(s: &str) -> Result<ProfileFormat, Error> {
+    Ok(match s {
+        "text" => ProfileFormat::Text,
+        "json" => ProfileFormat::Json,
+        "chrome" => ProfileFormat::Chrome,
+        _ => return Err(format_err!("Invalid profile format: `{}`", s)),
+    })
+}
+
+/// Collect the spans of the stages
+pub struct Recorder {
+    start: Instant,
+    spans: Arc<Mutex<Vec<Span>>>,
+}
+
+impl Recorder {
+    pub fn new() -> Self {
+        Self {
+            start: Instant::now(),
+            spans: Arc::new(Mutex::new(vec![])),
+        }
+    }
+
+    pub fn profiler(&self) -> Profiler {
+        let spans = self.spans.clone();
+        Arc::new(move |span: &Span| spans.lock().unwrap().push(span.clone()))
+    }
+
+    /// Format the spans recorded so far
+    pub fn report(&self, format: ProfileFormat) -> String {
+        let spans = self.spans.lock().unwrap();
+        let micros = |span: &Span| span.start.duration_since(self.start).as_micros();
+
+        match format {
+            ProfileFormat::Text => {
+                // total of each stage, in the order in which they first ended
+                let mut stages: Vec<(&str, usize, f64, u64)> = vec![];
+                for span in spans.iter() {
+                    let ms = span.duration.as_secs_f64() * 1000.0;
+                    match stages.iter_mut().find(|stage| stage.0 == span.name) {
+                        Some(stage) => {
+                            stage.1 += 1;
+                            stage.2 += ms;
+                            stage.3 += span.allocated;
+                        }
+                        None => stages.push((span.name, 1, ms, span.allocated)),
+                    }
+                }
+
+                let mut report = format!(
+                    "{:<16}{:>8}{:>12}{:>16}\n",
+                    "stage", "count", "time (ms)", "allocated (KB)"
+                );
+                for (name, count, ms, allocated) in stages {
+                    report += &format!(
+                        "{:<16}{:>8}{:>12.2}{:>16}\n",
+                        name,
+                        count,
+                        ms,
+                        allocated / 1024
+                    );
+                }
+                report += &format!(
+                    "{:<16}{:>8}{:>12.2}\n",
+                    "total",
+                    "",
+                    self.start.elapsed().as_secs_f64() * 1000.0
+                );
+                report
+            }
+            ProfileFormat::Json => {
+                let spans = spans
+                    .iter()
+                    .map(|span| {
+                        format!(
+                            r#"{{"name":"{}","thread":{},"start_us":{},"duration_us":{},"allocated":{}}}"#,
+                            span.name,
+                            span.thread,
+                            micros(span),
+                            span.duration.as_micros(),
+                            span.allocated
+                        )
+                    })
+                    .collect::<Vec<_>>();
+                format!("[{}]\n", spans.join(","))
+            }
+            ProfileFormat::Chrome => {
+                let events = spans
+                    .iter()
+                    .map(|span| {
+                        format!(
+                            r#"{{"name":"{}","ph":"X","pid":1,"tid":{},"ts":{},"dur":{},"args":{{"allocated":{}}}}}"#,
+                            span.name,
+                            span.thread,
+                            micros(span),
+                            span.duration.as_micros(),
+                            span.allocated
+                        )
+                    })
+                    .collect::<Vec<_>>();
+                format!("{{\"traceEvents\":[{}]}}\n", events.join(","))
+            }
+        }
+    }
+}
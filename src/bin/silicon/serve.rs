@@ -0,0 +1,476 @@
+//! A render server which keeps the syntaxes, themes and fonts loaded
+//!
+//! A client connects to the unix socket and sends a line of arguments (the same as the
+//! arguments of silicon, eg. `-l rs --theme Dracula`), then the code, and shuts down
+//! the writing half of the connection. The server replies `OK <length>\n` followed by
+//! the PNG image, or `ERROR <message>\n`.
+//!
+//! The arguments of a request override the options of the server, including those of its
+//! config file. Only the options which change the look of the image are accepted from the
+//! clients, and the theme must be one of the themes loaded by the server, so a client can't
+//! make the server read or write other files. The sizes are clamped, and a request for an
+//! image which would be too big is refused before it is drawn. The socket is only
+//! accessible by its owner.
+use crate::config::Config;
+use anyhow::Error;
+use silicon::formatter::{ImageFormatter, RenderContext};
+use silicon::highlight::highlight_range;
+use std::collections::HashMap;
+use std::fs;
+use std::io::{self, BufRead, BufReader, ErrorKind, Read, Write};
+use std::ops::Range;
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::panic::{self, AssertUnwindSafe};
+use std::path::Path;
+use std::sync::mpsc::{sync_channel, Receiver, TrySendError};
+use std::sync::{Arc, Mutex, PoisonError};
+use std::thread;
+use std::time::{Duration, Instant};
+use structopt::StructOpt;
+use syntect::easy::HighlightLines;
+use syntect::highlighting::ThemeSet;
+use syntect::parsing::SyntaxSet;
+use syntect::util::LinesWithEndings;
+
+/// Max number of formatters kept by the server, one for each distinct set of options
+const MAX_FORMATTERS: usize = 16;
+
+/// Time allowed to a client to send its whole request
+const REQUEST_TIMEOUT: Duration = Duration::from_secs(10);
+
+/// Time allowed to a client to read each part of the reply
+const WRITE_TIMEOUT: Duration = Duration::from_secs(10);
+
+/// Max size of the line of arguments of a request
+const MAX_ARGS_SIZE: u64 = 4 << 10;
+
+/// Max size of the code of a request
+const MAX_CODE_SIZE: u64 = 16 << 20;
+
+/// Max values of the options which make the image bigger or slower to draw
+const MAX_PAD: u32 = 1000;
+const MAX_LINE_PAD: u32 = 100;
+const MAX_BLUR_RADIUS: f32 = 100.0;
+const MAX_FONTS: usize = 8;
+const MAX_FONT_SIZE: f32 = 200.0;
+const MAX_TAB_WIDTH: u8 = 16;
+const MAX_HIGHLIGHT_LINES: u64 = 1 << 16;
+
+/// Max width or height of an image, in pixels
+const MAX_IMAGE_SIDE: f64 = 65536.0;
+
+/// Max number of pixels of an image
+const MAX_IMAGE_PIXELS: f64 = (1u64 << 27) as f64;
+
+/// The options accepted from the clients: short name, long name and whether they take a
+/// value
+const CLIENT_OPTIONS: &[(Option<&str>, &str, bool)] = &[
+    (Some("-b"), "--background", true),
+    (Some("-f"), "--font", true),
+    (None, "--highlight-lines", true),
+    (Some("-l"), "--language", true),
+    (None, "--lines", true),
+    (None, "--line-offset", true),
+    (None, "--line-pad", true),
+    (None, "--no-line-number", false),
+    (None, "--no-round-corner", false),
+    (None, "--no-window-controls", false),
+    (None, "--pad-horiz", true),
+    (None, "--pad-vert", true),
+    (None, "--png-compression", true),
+    (None, "--png-filter", true),
+    (None, "--png-palette", false),
+    (None, "--shadow-blur-radius", true),
+    (None, "--shadow-color", true),
+    (None, "--shadow-offset-x", true),
+    (None, "--shadow-offset-y", true),
+    (None, "--tab-width", true),
+    (None, "--theme", true),
+];
+
+/// The long names of the options given in the arguments of a request, which may only
+/// contain the options accepted from clients
+fn client_options(args: &[String]) -> Result<Vec<&'static str>, Error> {
+    let mut options = vec![];
+    let mut args = args.iter();
+    while let Some(arg) = args.next() {
+        // `--option=value` or `-lvalue`
+        let (name, value) = match arg.find('=') {
+            Some(i) if arg.starts_with("--") => (&arg[..i], Some(&arg[i + 1..])),
+            _ if !arg.starts_with("--") && arg.len() > 2 => {
+                (arg.get(..2).unwrap_or(arg), arg.get(2..))
+            }
+            _ => (arg.as_str(), None),
+        };
+        let &(_, long, takes_value) = CLIENT_OPTIONS
+            .iter()
+            .find(|(short, long, _)| *long == name || *short == Some(name))
+            .ok_or_else(|| format_err!("Option not allowed: {}", arg))?;
+
+        let value = match (takes_value, value) {
+            (true, None) => args.next().map(|value| value.as_str()),
+            (false, Some(_)) => return Err(format_err!("Unexpected value: {}", arg)),
+            (_, value) => value,
+        };
+        // the lines are expanded to a list when they are parsed
+        if let (true, Some(value)) = (long == "--highlight-lines", value) {
+            check_highlight_lines(value)?;
+        }
+        options.push(long);
+    }
+    Ok(options)
+}
+
+/// Refuse lists of highlighted lines which are too long to expand
+fn check_highlight_lines(lines: &str) -> Result<(), Error> {
+    let count = lines
+        .split(';')
+        .map(|range| {
+            let mut bounds = range
+                .split('-')
+                .map(|n| n.trim().parse::<u64>().unwrap_or(0));
+            match (bounds.next(), bounds.next()) {
+                (Some(start), Some(end)) => (end + 1).saturating_sub(start),
+                _ => 1,
+            }
+        })
+        .sum::<u64>();
+    if count > MAX_HIGHLIGHT_LINES {
+        return Err(format_err!("Too many highlighted lines: {}", count));
+    }
+    Ok(())
+}
+
+/// Set the option of the server's config to its value in the request
+fn override_option(config: &mut Config, request: &Config, option: &str) {
+    match option {
+        "--background" => config.background = request.background,
+        "--font" => config.font = request.font.clone(),
+        "--highlight-lines" => config.highlight_lines = request.highlight_lines.clone(),
+        "--language" => config.language = request.language.clone(),
+        "--lines" => config.lines = request.lines,
+        "--line-offset" => config.line_offset = request.line_offset,
+        "--line-pad" => config.line_pad = request.line_pad,
+        "--no-line-number" => config.no_line_number = true,
+        "--no-round-corner" => config.no_round_corner = true,
+        "--no-window-controls" => config.no_window_controls = true,
+        "--pad-horiz" => config.pad_horiz = request.pad_horiz,
+        "--pad-vert" => config.pad_vert = request.pad_vert,
+        "--png-compression" => config.png_compression = request.png_compression,
+        "--png-filter" => config.png_filter = request.png_filter,
+        "--png-palette" => config.png_palette = true,
+        "--shadow-blur-radius" => config.shadow_blur_radius = request.shadow_blur_radius,
+        "--shadow-color" => config.shadow_color = request.shadow_color,
+        "--shadow-offset-x" => config.shadow_offset_x = request.shadow_offset_x,
+        "--shadow-offset-y" => config.shadow_offset_y = request.shadow_offset_y,
+        "--tab-width" => config.tab_width = request.tab_width,
+        "--theme" => config.theme = request.theme.clone(),
+        _ => unreachable!("{} is not a client option", option),
+    }
+}
+
+/// Clamp the options which make the image bigger or slower to draw
+fn clamp_options(config: &mut Config) {
+    config.pad_horiz = config.pad_horiz.min(MAX_PAD);
+    config.pad_vert = config.pad_vert.min(MAX_PAD);
+    config.line_pad = config.line_pad.min(MAX_LINE_PAD);
+    config.tab_width = config.tab_width.min(MAX_TAB_WIDTH);
+    config.shadow_blur_radius = config.shadow_blur_radius.max(0.0).min(MAX_BLUR_RADIUS);
+    let offset = MAX_PAD as i32;
+    config.shadow_offset_x = config.shadow_offset_x.max(-offset).min(offset);
+    config.shadow_offset_y = config.shadow_offset_y.max(-offset).min(offset);
+    if let Some(fonts) = &mut config.font {
+        fonts.truncate(MAX_FONTS);
+        for (_, size) in fonts {
+            *size = size.max(1.0).min(MAX_FONT_SIZE);
+        }
+    }
+}
+
+/// Refuse the code if its image could be too big, before anything is drawn.
+///
+/// The size is estimated with glyphs one em wide and lines 1.5 ems high, which is more than
+/// the fonts need.
+fn check_image_size(
+    config: &Config,
+    code: &str,
+    window: Option<&Range<usize>>,
+) -> Result<(), Error> {
+    let em = config
+        .font
+        .iter()
+        .flatten()
+        .map(|(_, size)| f64::from(*size))
+        .fold(26.0, f64::max);
+    let (skip, take) = window.map_or((0, usize::MAX), |window| (window.start, window.len()));
+    let (lines, columns) =
+        code.lines()
+            .skip(skip)
+            .take(take)
+            .fold((0, 0), |(lines, columns), line| {
+                let width = line
+                    .chars()
+                    .map(|c| match c {
+                        '\t' => usize::from(config.tab_width),
+                        _ => 1,
+                    })
+                    .sum::<usize>();
+                (lines + 1, columns.max(width))
+            });
+
+    // the line numbers, the code pad and the window controls are less than 16 ems
+    let width = (columns + 16) as f64 * em + f64::from(config.pad_horiz) * 2.0;
+    let height = (lines + 4) as f64 * (em * 1.5 + f64::from(config.line_pad))
+        + f64::from(config.pad_vert) * 2.0;
+    if width > MAX_IMAGE_SIDE || height > MAX_IMAGE_SIDE || width * height > MAX_IMAGE_PIXELS {
+        return Err(format_err!(
+            "The image would be too big: about {}x{}",
+            width as u64,
+            height as u64
+        ));
+    }
+    Ok(())
+}
+
+/// Reads the stream until a deadline, however slowly the client sends its request
+struct DeadlineReader<'a> {
+    stream: &'a UnixStream,
+    deadline: Instant,
+}
+
+impl Read for DeadlineReader<'_> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let left = self.deadline.saturating_duration_since(Instant::now());
+        if left == Duration::from_secs(0) {
+            return Err(io::Error::new(
+                ErrorKind::TimedOut,
+                "The request took too long",
+            ));
+        }
+        self.stream.set_read_timeout(Some(left))?;
+        let mut stream = self.stream;
+        stream.read(buf)
+    }
+}
+
+/// Formatters built for the options of previous requests, shared by the workers
+type Formatters = Arc<Mutex<HashMap<String, Arc<ImageFormatter>>>>;
+
+struct Worker {
+    /// the options of the server, overridden by those of each request
+    config: Arc<Config>,
+    ps: Arc<SyntaxSet>,
+    ts: Arc<ThemeSet>,
+    formatters: Formatters,
+    /// buffers reused by all the requests
+    context: RenderContext,
+}
+
+impl Worker {
+    fn new(
+        config: Arc<Config>,
+        ps: Arc<SyntaxSet>,
+        ts: Arc<ThemeSet>,
+        formatters: Formatters,
+    ) -> Self {
+        Self {
+            config,
+            ps,
+            ts,
+            formatters,
+            context: RenderContext::new(),
+        }
+    }
+
+    fn run(mut self, queue: Arc<Mutex<Receiver<UnixStream>>>) {
+        loop {
+            // release the lock before handling the request. A worker never panics while it
+            // holds the lock, but the queue is still usable if one does.
+            let stream = queue.lock().unwrap_or_else(PoisonError::into_inner).recv();
+            match stream {
+                Ok(stream) => self.handle(stream),
+                Err(_) => return,
+            }
+        }
+    }
+
+    fn handle(&mut self, mut stream: UnixStream) {
+        let deadline = Instant::now() + REQUEST_TIMEOUT;
+        let response = panic::catch_unwind(AssertUnwindSafe(|| self.render(&stream, deadline)))
+            .unwrap_or_else(|_| {
+                // the buffers may have been left in any state
+                self.context = RenderContext::new();
+                Err(format_err!("The render panicked"))
+            });
+
+        let result = stream
+            .set_write_timeout(Some(WRITE_TIMEOUT))
+            .and_then(|_| match response {
+                Ok(image) => {
+                    writeln!(stream, "OK {}", image.len()).and_then(|_| stream.write_all(&image))
+                }
+                Err(e) => writeln!(stream, "ERROR {}", e.to_string().replace('\n', " ")),
+            });
+        if let Err(e) = result {
+            eprintln!("[error] Failed to reply: {}", e);
+        }
+    }
+
+    fn render(&mut self, stream: &UnixStream, deadline: Instant) -> Result<Vec<u8>, Error> {
+        let mut reader = BufReader::new(DeadlineReader { stream, deadline });
+
+        let mut args = String::new();
+        reader.by_ref().take(MAX_ARGS_SIZE).read_line(&mut args)?;
+        if !args.ends_with('\n') && args.len() as u64 == MAX_ARGS_SIZE {
+            return Err(format_err!("The arguments are too long"));
+        }
+        let args = shell_words::split(&args)?;
+        let options = client_options(&args)?;
+
+        let mut code = String::new();
+        reader.take(MAX_CODE_SIZE + 1).read_to_string(&mut code)?;
+        if code.len() as u64 > MAX_CODE_SIZE {
+            return Err(format_err!("The code is too long"));
+        }
+
+        // `--serve` is only given to satisfy the required arguments
+        let request = Config::from_iter_safe(
+            ["silicon", "--serve", "-"]
+                .iter()
+                .map(|s| s.to_string())
+                .chain(args.iter().cloned()),
+        )?;
+        let mut config = (*self.config).clone();
+        for option in options {
+            override_option(&mut config, &request, option);
+        }
+        clamp_options(&mut config);
+
+        let window = config.line_window(&code)?;
+        check_image_size(&config, &code, window.as_ref())?;
+
+        let syntax = match &config.language {
+            Some(language) => self
+                .ps
+                .find_syntax_by_token(language)
+                .ok_or_else(|| format_err!("Unsupported language: {}", language))?,
+            None => self
+                .ps
+                .find_syntax_by_first_line(&code)
+                .ok_or_else(|| format_err!("Failed to detect the language"))?,
+        };
+        // a theme which isn't loaded would be read from a file
+        let theme = self
+            .ts
+            .themes
+            .get(&config.theme)
+            .ok_or_else(|| format_err!("Unknown theme: {}", config.theme))?;
+
+        let formatter = self.formatter(&config)?;
+
+        let highlight = match window {
+            Some(window) => highlight_range(&code, window, syntax, theme, &self.ps),
+            None => {
+                let mut h = HighlightLines::new(syntax, theme);
+                LinesWithEndings::from(&code)
+                    .map(|line| h.highlight(line, &self.ps))
+                    .collect::<Vec<_>>()
+            }
+        };
+
+        Ok(formatter.format_png_with(&highlight, theme, &mut self.context, vec![])?)
+    }
+
+    /// The formatter for the options, built if no worker has built it yet. The theme and the
+    /// language don't change the formatter, so they don't need another one.
+    fn formatter(&self, config: &Config) -> Result<Arc<ImageFormatter>, Error> {
+        let lock = || {
+            self.formatters
+                .lock()
+                .unwrap_or_else(PoisonError::into_inner)
+        };
+        let key = config.image_options();
+        if let Some(formatter) = lock().get(&key) {
+            return Ok(formatter.clone());
+        }
+
+        // built without the lock, the other workers keep rendering meanwhile
+        let formatter = Arc::new(config.get_formatter(None)?);
+        let mut formatters = lock();
+        if formatters.len() >= MAX_FORMATTERS {
+            formatters.clear();
+        }
+        formatters.insert(key, formatter.clone());
+        Ok(formatter)
+    }
+}
+
+/// Bind the socket, which only the user running the server may connect to
+fn bind(path: &Path) -> Result<UnixListener, Error> {
+    match bind_private(path) {
+        Err(e) if e.kind() == ErrorKind::AddrInUse => {
+            // the socket may be left by a server which is not running anymore
+            if UnixStream::connect(path).is_ok() {
+                return Err(format_err!("{} is used by another server", path.display()));
+            }
+            fs::remove_file(path)?;
+            Ok(bind_private(path)?)
+        }
+        result => Ok(result?),
+    }
+}
+
+/// Bind the socket with the permissions 0600, which it has from the moment it is created
+fn bind_private(path: &Path) -> io::Result<UnixListener> {
+    // the umask is process-wide, but the workers aren't started yet, so no other thread
+    // creates files meanwhile
+    let umask = unsafe { libc::umask(0o177) };
+    let listener = UnixListener::bind(path);
+    unsafe { libc::umask(umask) };
+    listener
+}
+
+/// Serve render requests on the unix socket.
+///
+/// Requests are handled by `config.jobs` workers, at most `config.queue_size` connections
+/// wait for a worker, the others are refused at once.
+pub fn serve(config: &Config, path: &Path, ps: SyntaxSet, ts: ThemeSet) -> Result<(), Error> {
+    let listener = bind(path)?;
+    let (ps, ts) = (Arc::new(ps), Arc::new(ts));
+
+    let (sender, receiver) = sync_channel(config.queue_size);
+    let receiver = Arc::new(Mutex::new(receiver));
+
+    let workers = match config.jobs {
+        0 => rayon::current_num_threads(),
+        n => n,
+    };
+    let formatters = Formatters::default();
+    let config = Arc::new(config.clone());
+    for _ in 0..workers {
+        let (ps, ts, receiver) = (ps.clone(), ts.clone(), receiver.clone());
+        let config = config.clone();
+        let formatters = formatters.clone();
+        // the workers share the formatters, each of them keeps its own buffers
+        thread::spawn(move || Worker::new(config, ps, ts, formatters).run(receiver));
+    }
+
+    for stream in listener.incoming() {
+        let stream = match stream {
+            Ok(stream) => stream,
+            Err(e) => {
+                eprintln!("[error] Failed to accept connection: {}", e);
+                continue;
+            }
+        };
+        match sender.try_send(stream) {
+            Ok(()) => (),
+            Err(TrySendError::Full(mut stream)) => {
+                let _ = stream.write_all(b"ERROR The server is busy\n");
+            }
+            Err(TrySendError::Disconnected(_)) => break,
+        }
+    }
+
+    Ok(())
+}
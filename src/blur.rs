@@ -4,51 +4,96 @@
 //! Edited by aloxaf <aloxafx@gmail.com> to process RgbaImage
 
 use image::RgbaImage;
-use std::cmp::min;
+use rayon::prelude::*;
+
+/// Number of columns transposed together, so that reads of a row stay in one cache line
+const TRANSPOSE_BLOCK: usize = 16;
 
 pub fn gaussian_blur(image: RgbaImage, sigma: f32) -> RgbaImage {
+    gaussian_blur_with(image, sigma, true)
+}
+
+/// Blur the image like `gaussian_blur`, on the current thread only if `parallel` is false
+pub(crate) fn gaussian_blur_with(image: RgbaImage, sigma: f32, parallel: bool) -> RgbaImage {
     let (width, height) = image.dimensions();
     let mut raw = image.into_raw();
-    let len = raw.len();
 
-    // fastblur::gaussian_blur only accepts Vec<[u8; 4]>
-    unsafe {
-        raw.set_len(len / 4);
+    gaussian_blur_impl(&mut raw, width as usize, height as usize, sigma, parallel);
 
-        let ptr = &mut *(&mut raw as *mut Vec<u8> as *mut Vec<[u8; 4]>);
-        gaussian_blur_impl(ptr, width as usize, height as usize, sigma);
+    RgbaImage::from_raw(width, height, raw).unwrap()
+}
 
-        raw.set_len(len);
+fn gaussian_blur_impl(
+    data: &mut [u8],
+    width: usize,
+    height: usize,
+    blur_radius: f32,
+    parallel: bool,
+) {
+    if width == 0 || height == 0 {
+        return;
     }
 
-    RgbaImage::from_raw(width, height, raw).unwrap()
+    let radii = create_box_gauss(blur_radius, 3)
+        .into_iter()
+        .map(|size| ((size - 1) / 2) as usize)
+        .collect::<Vec<_>>();
+    let mut backbuf = vec![0; data.len()];
+
+    // Box blurs are separable and commute with each other, so all the horizontal passes
+    // are done first, then the vertical ones as horizontal passes over the transposed image.
+    // This way every pass reads memory sequentially and rows can be blurred in parallel.
+    // Each pass rounds to u8, so the result may differ by a level from alternating the
+    // horizontal and vertical passes.
+    box_blur_rows(data, &mut backbuf, width, &radii, parallel);
+    transpose(data, &mut backbuf, width, height, parallel);
+    box_blur_rows(&mut backbuf, data, height, &radii, parallel);
+    transpose(&backbuf, data, height, width, parallel);
 }
 
-fn gaussian_blur_impl(data: &mut Vec<[u8; 4]>, width: usize, height: usize, blur_radius: f32) {
-    let bxs = create_box_gauss(blur_radius, 3);
-    let mut backbuf = data.clone();
-
-    box_blur(
-        &mut backbuf,
-        data,
-        width,
-        height,
-        ((bxs[0] - 1) / 2) as usize,
-    );
-    box_blur(
-        &mut backbuf,
-        data,
-        width,
-        height,
-        ((bxs[1] - 1) / 2) as usize,
-    );
-    box_blur(
-        &mut backbuf,
-        data,
-        width,
-        height,
-        ((bxs[2] - 1) / 2) as usize,
-    );
+/// Blur a range of a line the same way as `gaussian_blur`, without blurring an image.
+///
+/// It returns the blurred value of a line of `len` pixels which are 1 in `start..end`
+/// and 0 elsewhere. Since the blur is separable, the blurred value of a rectangle
+/// at (x, y) is `horiz[x] * vert[y]`.
+pub fn blur_profile(len: usize, start: i64, end: i64, sigma: f32) -> Vec<f32> {
+    // box blurs of an indicator are sums of integers, so blur unnormalized sums
+    // to get an exact result
+    let mut profile = (0..len as i64)
+        .map(|i| (i >= start && i < end) as u64)
+        .collect::<Vec<_>>();
+    let mut backbuf = vec![0; len];
+    let mut total = 1;
+
+    for size in create_box_gauss(sigma, 3) {
+        box_sum_line(&profile, &mut backbuf, ((size - 1) / 2) as usize);
+        std::mem::swap(&mut profile, &mut backbuf);
+        total *= size as u64;
+    }
+
+    profile
+        .into_iter()
+        .map(|sum| (sum as f64 / total as f64) as f32)
+        .collect()
+}
+
+/// Sum up every `2 * radius + 1` values of a line, values beyond the edges are taken
+/// as the values on the edges.
+fn box_sum_line(backbuf: &[u64], frontbuf: &mut [u64], radius: usize) {
+    if backbuf.is_empty() {
+        return;
+    }
+
+    let last = backbuf.len() as isize - 1;
+    let value = |i: isize| backbuf[i.max(0).min(last) as usize];
+    let radius = radius as isize;
+
+    let mut sum = (-radius..=radius).map(value).sum::<u64>();
+    for (i, v) in frontbuf.iter_mut().enumerate() {
+        *v = sum;
+        sum += value(i as isize + radius + 1);
+        sum -= value(i as isize - radius);
+    }
 }
 
 #[inline]
@@ -86,268 +131,186 @@ fn create_box_gauss(sigma: f32, n: usize) -> Vec<i32> {
     sizes
 }
 
-/// Needs 2x the same image
-#[inline]
-fn box_blur(
-    backbuf: &mut Vec<[u8; 4]>,
-    frontbuf: &mut Vec<[u8; 4]>,
+/// Blur every row of `data` with boxes of the given radii, `backbuf` is used as scratch space
+fn box_blur_rows(
+    data: &mut [u8],
+    backbuf: &mut [u8],
     width: usize,
-    height: usize,
-    blur_radius: usize,
+    radii: &[usize],
+    parallel: bool,
 ) {
-    box_blur_horz(backbuf, frontbuf, width, height, blur_radius);
-    box_blur_vert(frontbuf, backbuf, width, height, blur_radius);
+    let blur = |(row, scratch): (&mut [u8], &mut [u8])| {
+        let mut in_row = true;
+        for &radius in radii {
+            if in_row {
+                box_blur_row(row, scratch, radius);
+            } else {
+                box_blur_row(scratch, row, radius);
+            }
+            in_row = !in_row;
+        }
+        if !in_row {
+            row.copy_from_slice(scratch);
+        }
+    };
+
+    if parallel {
+        data.par_chunks_mut(width * 4)
+            .zip(backbuf.par_chunks_mut(width * 4))
+            .for_each(blur);
+    } else {
+        data.chunks_mut(width * 4)
+            .zip(backbuf.chunks_mut(width * 4))
+            .for_each(blur);
+    }
 }
 
+/// Blur a row of RGBA pixels with a box of `2 * blur_radius + 1` pixels.
+///
+/// Pixels beyond the edges are taken as the pixels on the edges. Only the pixels near the
+/// edges need that, the others are blurred by a loop without clamping or branches.
 #[inline]
-fn box_blur_vert(
-    backbuf: &[[u8; 4]],
-    frontbuf: &mut [[u8; 4]],
-    width: usize,
-    height: usize,
-    blur_radius: usize,
-) {
-    let iarr = 1.0 / (blur_radius + blur_radius + 1) as f32;
-
-    for i in 0..width {
-        let col_start = i; //inclusive
-        let col_end = i + width * (height - 1); //inclusive
-        let mut ti: usize = i;
-        let mut li: usize = ti;
-        let mut ri: usize = ti + blur_radius * width;
-
-        let fv: [u8; 4] = backbuf[col_start];
-        let lv: [u8; 4] = backbuf[col_end];
-
-        let mut val_r: isize = (blur_radius as isize + 1) * isize::from(fv[0]);
-        let mut val_g: isize = (blur_radius as isize + 1) * isize::from(fv[1]);
-        let mut val_b: isize = (blur_radius as isize + 1) * isize::from(fv[2]);
-        let mut val_a: isize = (blur_radius as isize + 1) * isize::from(fv[3]);
-
-        // Get the pixel at the specified index, or the first pixel of the column
-        // if the index is beyond the top edge of the image
-        let get_top = |i: usize| {
-            if i < col_start {
-                fv
-            } else {
-                backbuf[i]
-            }
-        };
+fn box_blur_row(backbuf: &[u8], frontbuf: &mut [u8], blur_radius: usize) {
+    let width = backbuf.len() / 4;
+    if blur_radius == 0 {
+        frontbuf.copy_from_slice(backbuf);
+        return;
+    }
 
-        // Get the pixel at the specified index, or the last pixel of the column
-        // if the index is beyond the bottom edge of the image
-        let get_bottom = |i: usize| {
-            if i > col_end {
-                lv
-            } else {
-                backbuf[i]
-            }
-        };
-
-        for j in 0..min(blur_radius, height) {
-            let bb = backbuf[ti + j * width];
-            val_r += isize::from(bb[0]);
-            val_g += isize::from(bb[1]);
-            val_b += isize::from(bb[2]);
-            val_a += isize::from(bb[3]);
+    // offset of the pixel at the specified index, clamped to the row
+    let last = width as isize - 1;
+    let offset = |i: isize| i.max(0).min(last) as usize * 4;
+
+    // `val * iarr >> 32` is `val / (2 * blur_radius + 1)`, with enough precision for u8
+    // since the sums fit in u32
+    let iarr = (1u64 << 32) / (blur_radius as u64 * 2 + 1);
+    let radius = blur_radius as isize;
+    let store = |pixel: &mut [u8], val: &[u32; 4]| {
+        for c in 0..4 {
+            pixel[c] = ((u64::from(val[c]) * iarr + (1 << 31)) >> 32) as u8;
         }
-        if blur_radius > height {
-            val_r += (blur_radius - height) as isize * isize::from(lv[0]);
-            val_g += (blur_radius - height) as isize * isize::from(lv[1]);
-            val_b += (blur_radius - height) as isize * isize::from(lv[2]);
-            val_a += (blur_radius - height) as isize * isize::from(lv[3]);
+    };
+
+    let mut val = [0u32; 4];
+    for i in -radius..=radius {
+        let o = offset(i);
+        for c in 0..4 {
+            val[c] += u32::from(backbuf[o + c]);
         }
+    }
 
-        for _ in 0..min(height, blur_radius + 1) {
-            let bb = get_bottom(ri);
-            ri += width;
-            val_r += isize::from(bb[0]) - isize::from(fv[0]);
-            val_g += isize::from(bb[1]) - isize::from(fv[1]);
-            val_b += isize::from(bb[2]) - isize::from(fv[2]);
-            val_a += isize::from(bb[3]) - isize::from(fv[3]);
-
-            frontbuf[ti] = [
-                round(val_r as f32 * iarr) as u8,
-                round(val_g as f32 * iarr) as u8,
-                round(val_b as f32 * iarr) as u8,
-                round(val_a as f32 * iarr) as u8,
-            ];
-            ti += width;
+    // the pixels entering and leaving the box are in the row in `head..tail`
+    let head = blur_radius.min(width);
+    let tail = width.saturating_sub(blur_radius + 1).max(head);
+    let slide = |val: &mut [u32; 4], entering: &[u8], leaving: &[u8]| {
+        for c in 0..4 {
+            val[c] = val[c] + u32::from(entering[c]) - u32::from(leaving[c]);
         }
+    };
 
-        if height > blur_radius {
-            // otherwise `(height - blur_radius)` will underflow
-            for _ in (blur_radius + 1)..(height - blur_radius) {
-                let bb1 = backbuf[ri];
-                ri += width;
-                let bb2 = backbuf[li];
-                li += width;
-
-                val_r += isize::from(bb1[0]) - isize::from(bb2[0]);
-                val_g += isize::from(bb1[1]) - isize::from(bb2[1]);
-                val_b += isize::from(bb1[2]) - isize::from(bb2[2]);
-                val_a += isize::from(bb1[3]) - isize::from(bb2[3]);
-
-                frontbuf[ti] = [
-                    round(val_r as f32 * iarr) as u8,
-                    round(val_g as f32 * iarr) as u8,
-                    round(val_b as f32 * iarr) as u8,
-                    round(val_a as f32 * iarr) as u8,
-                ];
-                ti += width;
-            }
+    // near the edges, the indexes are clamped
+    let edge = |i: usize, val: &mut [u32; 4], pixel: &mut [u8]| {
+        store(pixel, val);
+        let (ri, li) = (offset(i as isize + radius + 1), offset(i as isize - radius));
+        slide(val, &backbuf[ri..][..4], &backbuf[li..][..4]);
+    };
 
-            for _ in 0..min(height - blur_radius - 1, blur_radius) {
-                let bb = get_top(li);
-                li += width;
-
-                val_r += isize::from(lv[0]) - isize::from(bb[0]);
-                val_g += isize::from(lv[1]) - isize::from(bb[1]);
-                val_b += isize::from(lv[2]) - isize::from(bb[2]);
-                val_a += isize::from(lv[3]) - isize::from(bb[3]);
-
-                frontbuf[ti] = [
-                    round(val_r as f32 * iarr) as u8,
-                    round(val_g as f32 * iarr) as u8,
-                    round(val_b as f32 * iarr) as u8,
-                    round(val_a as f32 * iarr) as u8,
-                ];
-                ti += width;
-            }
+    for i in 0..head {
+        edge(i, &mut val, &mut frontbuf[i * 4..][..4]);
+    }
+
+    if head < tail {
+        let pixels = frontbuf[head * 4..tail * 4].chunks_exact_mut(4);
+        let entering = backbuf[(head + blur_radius + 1) * 4..].chunks_exact(4);
+        let leaving = backbuf[(head - blur_radius) * 4..].chunks_exact(4);
+        for ((pixel, entering), leaving) in pixels.zip(entering).zip(leaving) {
+            store(pixel, &val);
+            slide(&mut val, entering, leaving);
         }
     }
-}
 
-#[inline]
-fn box_blur_horz(
-    backbuf: &[[u8; 4]],
-    frontbuf: &mut [[u8; 4]],
-    width: usize,
-    height: usize,
-    blur_radius: usize,
-) {
-    let iarr = 1.0 / (blur_radius + blur_radius + 1) as f32;
-
-    for i in 0..height {
-        let row_start: usize = i * width; // inclusive
-        let row_end: usize = (i + 1) * width - 1; // inclusive
-        let mut ti: usize = i * width; // VERTICAL: $i;
-        let mut li: usize = ti;
-        let mut ri: usize = ti + blur_radius;
-
-        let fv: [u8; 4] = backbuf[row_start];
-        let lv: [u8; 4] = backbuf[row_end]; // VERTICAL: $backbuf[ti + $width - 1];
-
-        let mut val_r: isize = (blur_radius as isize + 1) * isize::from(fv[0]);
-        let mut val_g: isize = (blur_radius as isize + 1) * isize::from(fv[1]);
-        let mut val_b: isize = (blur_radius as isize + 1) * isize::from(fv[2]);
-        let mut val_a: isize = (blur_radius as isize + 1) * isize::from(fv[3]);
-
-        // Get the pixel at the specified index, or the first pixel of the row
-        // if the index is beyond the left edge of the image
-        let get_left = |i: usize| {
-            if i < row_start {
-                fv
-            } else {
-                backbuf[i]
-            }
-        };
+    for i in tail..width {
+        edge(i, &mut val, &mut frontbuf[i * 4..][..4]);
+    }
+}
 
-        // Get the pixel at the specified index, or the last pixel of the row
-        // if the index is beyond the right edge of the image
-        let get_right = |i: usize| {
-            if i > row_end {
-                lv
-            } else {
-                backbuf[i]
+/// Transpose an image of `width * height` RGBA pixels to an image of `height * width`
+fn transpose(src: &[u8], dst: &mut [u8], width: usize, height: usize, parallel: bool) {
+    let transpose_block = |(block, rows): (usize, &mut [u8])| {
+        let x0 = block * TRANSPOSE_BLOCK;
+        let columns = rows.len() / (height * 4);
+        for y in 0..height {
+            let src_row = &src[(y * width + x0) * 4..][..columns * 4];
+            for (x, pixel) in src_row.chunks_exact(4).enumerate() {
+                rows[(x * height + y) * 4..][..4].copy_from_slice(pixel);
             }
-        };
-
-        for j in 0..min(blur_radius, width) {
-            let bb = backbuf[ti + j]; // VERTICAL: ti + j * width
-            val_r += isize::from(bb[0]);
-            val_g += isize::from(bb[1]);
-            val_b += isize::from(bb[2]);
-            val_a += isize::from(bb[3]);
-        }
-        if blur_radius > width {
-            val_r += (blur_radius - height) as isize * isize::from(lv[0]);
-            val_g += (blur_radius - height) as isize * isize::from(lv[1]);
-            val_b += (blur_radius - height) as isize * isize::from(lv[2]);
-            val_a += (blur_radius - height) as isize * isize::from(lv[3]);
         }
+    };
 
-        // Process the left side where we need pixels from beyond the left edge
-        for _ in 0..min(width, blur_radius + 1) {
-            let bb = get_right(ri);
-            ri += 1;
-            val_r += isize::from(bb[0]) - isize::from(fv[0]);
-            val_g += isize::from(bb[1]) - isize::from(fv[1]);
-            val_b += isize::from(bb[2]) - isize::from(fv[2]);
-            val_a += isize::from(bb[3]) - isize::from(fv[3]);
-
-            frontbuf[ti] = [
-                round(val_r as f32 * iarr) as u8,
-                round(val_g as f32 * iarr) as u8,
-                round(val_b as f32 * iarr) as u8,
-                round(val_a as f32 * iarr) as u8,
-            ];
-            ti += 1; // VERTICAL : ti += width, same with the other areas
-        }
+    let block = height * 4 * TRANSPOSE_BLOCK;
+    if parallel {
+        dst.par_chunks_mut(block)
+            .enumerate()
+            .for_each(transpose_block);
+    } else {
+        dst.chunks_mut(block).enumerate().for_each(transpose_block);
+    }
+}
 
-        if width > blur_radius {
-            // otherwise `(width - blur_radius)` will underflow
-            // Process the middle where we know we won't bump into borders
-            // without the extra indirection of get_left/get_right. This is faster.
-            for _ in (blur_radius + 1)..(width - blur_radius) {
-                let bb1 = backbuf[ri];
-                ri += 1;
-                let bb2 = backbuf[li];
-                li += 1;
-
-                val_r += isize::from(bb1[0]) - isize::from(bb2[0]);
-                val_g += isize::from(bb1[1]) - isize::from(bb2[1]);
-                val_b += isize::from(bb1[2]) - isize::from(bb2[2]);
-                val_a += isize::from(bb1[3]) - isize::from(bb2[3]);
-
-                frontbuf[ti] = [
-                    round(val_r as f32 * iarr) as u8,
-                    round(val_g as f32 * iarr) as u8,
-                    round(val_b as f32 * iarr) as u8,
-                    round(val_a as f32 * iarr) as u8,
-                ];
-                ti += 1;
-            }
+#[cfg(test)]
+mod tests {
+    use super::{box_blur_rows, create_box_gauss, gaussian_blur_impl, transpose};
+
+    /// Noise around an opaque rectangle, like a shadow
+    fn image(width: usize, height: usize) -> Vec<u8> {
+        let mut seed = 0x1234_5678u32;
+        (0..width * height * 4)
+            .map(|i| {
+                let (x, y) = ((i / 4) % width, (i / 4) / width);
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                let inside =
+                    x > width / 4 && x < width * 3 / 4 && y > height / 4 && y < height * 3 / 4;
+                if inside {
+                    255
+                } else {
+                    (seed >> 24) as u8
+                }
+            })
+            .collect()
+    }
 
-            // Process the right side where we need pixels from beyond the right edge
-            for _ in 0..min(width - blur_radius - 1, blur_radius) {
-                let bb = get_left(li);
-                li += 1;
-
-                val_r += isize::from(lv[0]) - isize::from(bb[0]);
-                val_g += isize::from(lv[1]) - isize::from(bb[1]);
-                val_b += isize::from(lv[2]) - isize::from(bb[2]);
-                val_a += isize::from(lv[3]) - isize::from(bb[3]);
-
-                frontbuf[ti] = [
-                    round(val_r as f32 * iarr) as u8,
-                    round(val_g as f32 * iarr) as u8,
-                    round(val_b as f32 * iarr) as u8,
-                    round(val_a as f32 * iarr) as u8,
-                ];
-                ti += 1;
-            }
+    /// The blur with a horizontal then a vertical pass for each box, in the original order
+    fn alternating_passes(data: &mut [u8], width: usize, height: usize, sigma: f32) {
+        let mut backbuf = vec![0; data.len()];
+        for size in create_box_gauss(sigma, 3) {
+            let radius = [((size - 1) / 2) as usize];
+            box_blur_rows(data, &mut backbuf, width, &radius, false);
+            transpose(data, &mut backbuf, width, height, false);
+            box_blur_rows(&mut backbuf, data, height, &radius, false);
+            transpose(&backbuf, data, height, width, false);
         }
     }
-}
 
-#[inline]
-/// Fast rounding for x <= 2^23.
-/// This is orders of magnitude faster than built-in rounding intrinsic.
-///
-/// Source: https://stackoverflow.com/a/42386149/585725
-fn round(mut x: f32) -> f32 {
-    x += 12_582_912.0;
-    x -= 12_582_912.0;
-    x
+    #[test]
+    fn pass_order() {
+        for &(width, height) in &[(37, 23), (64, 64), (5, 90), (200, 150)] {
+            for &sigma in &[1.0, 3.0, 10.0, 25.0] {
+                let mut blurred = image(width, height);
+                gaussian_blur_impl(&mut blurred, width, height, sigma, false);
+                let mut parallel = image(width, height);
+                gaussian_blur_impl(&mut parallel, width, height, sigma, true);
+                let mut expected = image(width, height);
+                alternating_passes(&mut expected, width, height, sigma);
+
+                assert!(blurred == parallel, "{}x{} sigma {}", width, height, sigma);
+                // the passes round in another order
+                for (&b, &e) in blurred.iter().zip(&expected) {
+                    let diff = (i32::from(b) - i32::from(e)).abs();
+                    assert!(diff <= 2, "{}x{} sigma {}: {}", width, height, sigma, diff);
+                }
+            }
+        }
+    }
 }
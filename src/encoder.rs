@@ -0,0 +1,664 @@
+//! A PNG encoder which takes the image band by band
+//!
+//! The rows are compressed as soon as they are written, so the whole image doesn't need
+//! to be in memory. With several threads, the rows are split into chunks which are
+//! compressed independently (the same as `pigz`) and joined with sync flushes.
+use crc32fast::Hasher;
+use flate2::{Compress, Compression, FlushCompress, Status};
+use image::{Rgba, RgbaImage};
+use rayon::prelude::*;
+use std::collections::HashMap;
+use std::io::{self, Write};
+
+/// Size of the compressed data which is buffered before writing an IDAT chunk
+const IDAT_SIZE: usize = 1 << 16;
+
+/// Size of the filtered data compressed at once by a thread
+const CHUNK_SIZE: usize = 1 << 18;
+
+/// Compression level of the image
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+pub enum CompressionLevel {
+    Fast,
+    Default,
+    Best,
+    /// a zlib level between 0 (no compression) and 9
+    Level(u32),
+}
+
+impl CompressionLevel {
+    fn to_flate2(self) -> Compression {
+        match self {
+            CompressionLevel::Fast => Compression::fast(),
+            CompressionLevel::Default => Compression::default(),
+            CompressionLevel::Best => Compression::best(),
+            CompressionLevel::Level(level) => Compression::new(level.min(9)),
+        }
+    }
+}
+
+/// Filter applied to the rows before compressing them
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+pub enum FilterType {
+    NoFilter,
+    Sub,
+    Up,
+    Avg,
+    Paeth,
+    /// choose the best filter for each row, it's slower but gives smaller images
+    Adaptive,
+}
+
+/// Options of the PNG encoder
+#[derive(Copy, Clone, Debug)]
+pub struct PngOptions {
+    /// Default: Default
+    pub compression: CompressionLevel,
+    /// Default: Sub
+    pub filter: FilterType,
+    /// Use an indexed palette when the image has at most 256 colors, this needs the whole
+    /// image at once.
+    /// Default: false
+    pub palette: bool,
+    /// Number of threads compressing the image, 0 means all cores
+    /// Default: 1
+    pub threads: usize,
+}
+
+impl Default for PngOptions {
+    fn default() -> Self {
+        Self {
+            compression: CompressionLevel::Default,
+            filter: FilterType::Sub,
+            palette: false,
+            threads: 1,
+        }
+    }
+}
+
+fn write_chunk<W: Write>(w: &mut W, kind: &[u8; 4], data: &[u8]) -> io::Result<()> {
+    let mut hasher = Hasher::new();
+    hasher.update(kind);
+    hasher.update(data);
+
+    w.write_all(&(data.len() as u32).to_be_bytes())?;
+    w.write_all(kind)?;
+    w.write_all(data)?;
+    w.write_all(&hasher.finalize().to_be_bytes())
+}
+
+/// Split the compressed data into IDAT chunks
+struct IdatWriter<W: Write> {
+    inner: W,
+    buffer: Vec<u8>,
+}
+
+impl<W: Write> IdatWriter<W> {
+    fn finish(mut self) -> io::Result<W> {
+        if !self.buffer.is_empty() {
+            write_chunk(&mut self.inner, b"IDAT", &self.buffer)?;
+        }
+        write_chunk(&mut self.inner, b"IEND", &[])?;
+        Ok(self.inner)
+    }
+}
+
+impl<W: Write> Write for IdatWriter<W> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        self.buffer.extend_from_slice(buf);
+        if self.buffer.len() >= IDAT_SIZE {
+            write_chunk(&mut self.inner, b"IDAT", &self.buffer)?;
+            self.buffer.clear();
+        }
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        // an IDAT chunk is written only when it's full
+        Ok(())
+    }
+}
+
+/// Adler-32 checksum of the uncompressed data, which ends the zlib stream
+struct Adler32 {
+    a: u32,
+    b: u32,
+}
+
+impl Adler32 {
+    fn new() -> Self {
+        Self { a: 1, b: 0 }
+    }
+
+    fn update(&mut self, data: &[u8]) {
+        // the sums cannot overflow in 5552 bytes
+        for chunk in data.chunks(5552) {
+            for &byte in chunk {
+                self.a += u32::from(byte);
+                self.b += self.a;
+            }
+            self.a %= 65521;
+            self.b %= 65521;
+        }
+    }
+
+    fn finish(&self) -> u32 {
+        self.b << 16 | self.a
+    }
+}
+
+/// Compress the data to raw deflate
+fn deflate(compress: &mut Compress, data: &[u8], flush: FlushCompress) -> io::Result<Vec<u8>> {
+    let start = compress.total_in();
+    let mut out = Vec::with_capacity(data.len() / 4 + 64);
+
+    loop {
+        let consumed = (compress.total_in() - start) as usize;
+        let status = compress
+            .compress_vec(&data[consumed..], &mut out, flush)
+            .map_err(|e| io::Error::new(io::ErrorKind::Other, e))?;
+
+        let consumed = (compress.total_in() - start) as usize;
+        // the flush is done once there is space left in the output
+        let done = consumed == data.len() && out.len() < out.capacity();
+        match status {
+            Status::StreamEnd => break,
+            _ if done && flush != FlushCompress::Finish => break,
+            _ => out.reserve(out.capacity()),
+        }
+    }
+    Ok(out)
+}
+
+fn paeth(a: u8, b: u8, c: u8) -> u8 {
+    let (ia, ib, ic) = (i16::from(a), i16::from(b), i16::from(c));
+    let p = ia + ib - ic;
+    let (pa, pb, pc) = ((p - ia).abs(), (p - ib).abs(), (p - ic).abs());
+    if pa <= pb && pa <= pc {
+        a
+    } else if pb <= pc {
+        b
+    } else {
+        c
+    }
+}
+
+/// Append the filter type and the filtered row to `out`
+fn filter_row(filter: FilterType, bpp: usize, row: &[u8], prev: &[u8], out: &mut Vec<u8>) {
+    let left = |i: usize| if i >= bpp { row[i - bpp] } else { 0 };
+    let up_left = |i: usize| if i >= bpp { prev[i - bpp] } else { 0 };
+
+    match filter {
+        FilterType::NoFilter | FilterType::Adaptive => {
+            out.push(0);
+            out.extend_from_slice(row);
+        }
+        FilterType::Sub => {
+            out.push(1);
+            out.extend_from_slice(&row[..bpp]);
+            out.extend(row[bpp..].iter().zip(row).map(|(&x, &a)| x.wrapping_sub(a)));
+        }
+        FilterType::Up => {
+            out.push(2);
+            out.extend(row.iter().zip(prev).map(|(&x, &b)| x.wrapping_sub(b)));
+        }
+        FilterType::Avg => {
+            out.push(3);
+            out.extend(row.iter().zip(prev).enumerate().map(|(i, (&x, &b))| {
+                let avg = (u16::from(left(i)) + u16::from(b)) / 2;
+                x.wrapping_sub(avg as u8)
+            }));
+        }
+        FilterType::Paeth => {
+            out.push(4);
+            out.extend(
+                row.iter()
+                    .zip(prev)
+                    .enumerate()
+                    .map(|(i, (&x, &b))| x.wrapping_sub(paeth(left(i), b, up_left(i)))),
+            );
+        }
+    }
+}
+
+/// Sum of the filtered bytes as signed values, the usual guess of how well a row compresses
+fn filter_cost(filtered: &[u8]) -> u64 {
+    filtered[1..]
+        .iter()
+        .map(|&x| u64::from((x as i8).unsigned_abs()))
+        .sum()
+}
+
+/// Encode an image to PNG, row by row
+pub struct PngEncoder<W: Write> {
+    inner: IdatWriter<W>,
+    options: PngOptions,
+    /// bytes per pixel
+    bpp: usize,
+    /// bytes per row
+    stride: usize,
+    /// number of rows not written yet
+    rows_left: u32,
+    /// the last row, before filtering
+    prev: Vec<u8>,
+    /// filtered rows, waiting to be compressed
+    pending: Vec<u8>,
+    /// rows filtered by each filter, when choosing the best one
+    candidate: Vec<u8>,
+    best: Vec<u8>,
+    /// the deflate stream, when there is only one thread
+    compress: Option<Compress>,
+    adler: Adler32,
+}
+
+impl<W: Write> PngEncoder<W> {
+    /// Write the header of a `width` x `height` RGBA image
+    pub fn new(w: W, width: u32, height: u32, options: &PngOptions) -> io::Result<Self> {
+        Self::with_header(w, width, height, 6, 4, &[], options)
+    }
+
+    /// Write the header of a `width` x `height` image whose pixels are indexes of the
+    /// palette, which has at most 256 colors.
+    pub fn with_palette(
+        w: W,
+        width: u32,
+        height: u32,
+        palette: &[Rgba<u8>],
+        options: &PngOptions,
+    ) -> io::Result<Self> {
+        if palette.is_empty() || palette.len() > 256 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "A palette should have 1 to 256 colors",
+            ));
+        }
+
+        let colors = palette
+            .iter()
+            .flat_map(|color| color.0[..3].to_vec())
+            .collect::<Vec<_>>();
+        let mut chunks = vec![(b"PLTE", colors)];
+
+        // the alpha of the colors, the trailing opaque ones can be omitted
+        let opaque = palette
+            .iter()
+            .rposition(|color| color.0[3] != 255)
+            .map_or(0, |i| i + 1);
+        if opaque > 0 {
+            let alpha = palette[..opaque].iter().map(|color| color.0[3]).collect();
+            chunks.push((b"tRNS", alpha));
+        }
+
+        Self::with_header(w, width, height, 3, 1, &chunks, options)
+    }
+
+    fn with_header(
+        mut w: W,
+        width: u32,
+        height: u32,
+        color_type: u8,
+        bpp: usize,
+        chunks: &[(&[u8; 4], Vec<u8>)],
+        options: &PngOptions,
+    ) -> io::Result<Self> {
+        if width == 0 || height == 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "Cannot encode an empty image",
+            ));
+        }
+
+        let mut header = Vec::with_capacity(13);
+        header.extend_from_slice(&width.to_be_bytes());
+        header.extend_from_slice(&height.to_be_bytes());
+        // 8 bits, deflate, adaptive filtering, no interlace
+        header.extend_from_slice(&[8, color_type, 0, 0, 0]);
+
+        w.write_all(b"\x89PNG\r\n\x1a\n")?;
+        write_chunk(&mut w, b"IHDR", &header)?;
+        for (kind, data) in chunks {
+            write_chunk(&mut w, kind, data)?;
+        }
+
+        let mut inner = IdatWriter {
+            inner: w,
+            buffer: Vec::with_capacity(IDAT_SIZE),
+        };
+        // the zlib header, the checksum is computed here and the data is raw deflate
+        inner.write_all(&[0x78, 0x9c])?;
+
+        let compress = match options.threads {
+            1 => Some(Compress::new(options.compression.to_flate2(), false)),
+            _ => None,
+        };
+        let stride = width as usize * bpp;
+        Ok(Self {
+            inner,
+            options: *options,
+            bpp,
+            stride,
+            rows_left: height,
+            prev: vec![0; stride],
+            pending: Vec::with_capacity(CHUNK_SIZE),
+            candidate: vec![],
+            best: vec![],
+            compress,
+            adler: Adler32::new(),
+        })
+    }
+
+    /// Write the next rows of the image, in RGBA or in palette indexes
+    pub fn write_rows(&mut self, rows: &[u8]) -> io::Result<()> {
+        let count = (rows.len() / self.stride) as u32;
+        if rows.len() % self.stride != 0 || count > self.rows_left {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "Rows don't fit the image",
+            ));
+        }
+
+        for row in rows.chunks_exact(self.stride) {
+            if self.options.filter == FilterType::Adaptive {
+                self.filter_adaptive(row);
+            } else {
+                filter_row(
+                    self.options.filter,
+                    self.bpp,
+                    row,
+                    &self.prev,
+                    &mut self.pending,
+                );
+            }
+            self.prev.copy_from_slice(row);
+
+            if self.pending.len() >= CHUNK_SIZE * self.chunks_at_once() {
+                self.compress_pending(false)?;
+            }
+        }
+        self.rows_left -= count;
+        Ok(())
+    }
+
+    fn filter_adaptive(&mut self, row: &[u8]) {
+        let filters = [
+            FilterType::NoFilter,
+            FilterType::Sub,
+            FilterType::Up,
+            FilterType::Avg,
+            FilterType::Paeth,
+        ];
+
+        let mut best_cost = u64::MAX;
+        for &filter in &filters {
+            self.candidate.clear();
+            filter_row(filter, self.bpp, row, &self.prev, &mut self.candidate);
+            let cost = filter_cost(&self.candidate);
+            if cost < best_cost {
+                best_cost = cost;
+                std::mem::swap(&mut self.candidate, &mut self.best);
+            }
+        }
+        self.pending.extend_from_slice(&self.best);
+    }
+
+    /// Number of chunks compressed in parallel
+    fn chunks_at_once(&self) -> usize {
+        match self.options.threads {
+            0 => rayon::current_num_threads(),
+            n => n,
+        }
+    }
+
+    fn compress_pending(&mut self, finish: bool) -> io::Result<()> {
+        self.adler.update(&self.pending);
+
+        match &mut self.compress {
+            Some(compress) => {
+                let flush = if finish {
+                    FlushCompress::Finish
+                } else {
+                    FlushCompress::None
+                };
+                let compressed = deflate(compress, &self.pending, flush)?;
+                self.inner.write_all(&compressed)?;
+            }
+            None => {
+                let level = self.options.compression.to_flate2();
+                let chunks = self
+                    .pending
+                    .par_chunks(CHUNK_SIZE)
+                    .map(|chunk| {
+                        let mut compress = Compress::new(level, false);
+                        deflate(&mut compress, chunk, FlushCompress::Sync)
+                    })
+                    .collect::<Vec<_>>();
+                for chunk in chunks {
+                    self.inner.write_all(&chunk?)?;
+                }
+                if finish {
+                    // an empty final block
+                    self.inner.write_all(&[0x03, 0x00])?;
+                }
+            }
+        }
+
+        self.pending.clear();
+        Ok(())
+    }
+
+    /// Finish the image and return the writer
+    pub fn finish(mut self) -> io::Result<W> {
+        if self.rows_left != 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                format!("{} rows of the image are missing", self.rows_left),
+            ));
+        }
+
+        self.compress_pending(true)?;
+        self.inner.write_all(&self.adler.finish().to_be_bytes())?;
+        self.inner.finish()
+    }
+}
+
+/// Get the palette of the image and the index of each pixel, if it has at most 256 colors
+pub fn build_palette(image: &RgbaImage) -> Option<(Vec<Rgba<u8>>, Vec<u8>)> {
+    let mut palette = vec![];
+    let mut indexes = HashMap::new();
+    let mut last = None;
+
+    let mut pixels = Vec::with_capacity(image.len() / 4);
+    for pixel in image.pixels() {
+        // neighbouring pixels are often the same
+        let index = match last {
+            Some((color, index)) if color == *pixel => index,
+            _ => {
+                let index = match indexes.get(pixel) {
+                    Some(&index) => index,
+                    None if palette.len() == 256 => return None,
+                    None => {
+                        let index = palette.len() as u8;
+                        indexes.insert(*pixel, index);
+                        palette.push(*pixel);
+                        index
+                    }
+                };
+                last = Some((*pixel, index));
+                index
+            }
+        };
+        pixels.push(index);
+    }
+
+    Some((palette, pixels))
+}
+
+/// Encode the whole image, with a palette if it's enabled and possible
+pub fn encode_png<W: Write>(image: &RgbaImage, w: W, options: &PngOptions) -> io::Result<W> {
+    let (width, height) = image.dimensions();
+
+    if options.palette {
+        if let Some((palette, pixels)) = build_palette(image) {
+            let mut encoder = PngEncoder::with_palette(w, width, height, &palette, options)?;
+            encoder.write_rows(&pixels)?;
+            return encoder.finish();
+        }
+        debug!("More than 256 colors, the palette is not used");
+    }
+
+    let mut encoder = PngEncoder::new(w, width, height, options)?;
+    encoder.write_rows(image)?;
+    encoder.finish()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{encode_png, FilterType, PngEncoder, PngOptions};
+    use image::{Rgba, RgbaImage};
+
+    const FILTERS: [FilterType; 6] = [
+        FilterType::NoFilter,
+        FilterType::Sub,
+        FilterType::Up,
+        FilterType::Avg,
+        FilterType::Paeth,
+        FilterType::Adaptive,
+    ];
+
+    /// An image with gradients and some transparency, so that the filters have work to do
+    fn gradient(width: u32, height: u32) -> RgbaImage {
+        RgbaImage::from_fn(width, height, |x, y| {
+            let alpha = 255 - (x % 3) as u8 * 60;
+            Rgba([(x * 7 + y) as u8, (y * 5) as u8, (x ^ y) as u8, alpha])
+        })
+    }
+
+    /// An image with `colors` colors (at most 256), every other one translucent
+    fn stripes(width: u32, height: u32, colors: u32) -> RgbaImage {
+        RgbaImage::from_fn(width, height, |x, y| {
+            let i = (x / 3 + y) % colors;
+            let alpha = if i % 2 == 0 { 255 } else { 128 };
+            Rgba([(i * 37) as u8, 255 - (i * 11) as u8, (i * 3) as u8, alpha])
+        })
+    }
+
+    /// The color type in the header of the PNG
+    fn color_type(png: &[u8]) -> u8 {
+        png[25]
+    }
+
+    fn has_chunk(png: &[u8], kind: &[u8; 4]) -> bool {
+        png.windows(4).any(|window| window == kind)
+    }
+
+    fn decode(png: &[u8]) -> RgbaImage {
+        image::load_from_memory(png).unwrap().to_rgba8()
+    }
+
+    /// Encode the image `band` rows at a time, then an empty band
+    fn encode_bands(image: &RgbaImage, band: u32, options: &PngOptions) -> Vec<u8> {
+        let (width, height) = image.dimensions();
+        let mut encoder = PngEncoder::new(vec![], width, height, options).unwrap();
+        for rows in image.as_raw().chunks((width * band * 4) as usize) {
+            encoder.write_rows(rows).unwrap();
+        }
+        encoder.write_rows(&[]).unwrap();
+        encoder.finish().unwrap()
+    }
+
+    #[test]
+    fn bands_round_trip() {
+        let options = PngOptions::default();
+        for &(width, height) in &[(37, 20), (64, 1), (1, 1)] {
+            let image = gradient(width, height);
+            for &band in &[1, 3, 7, height, height + 5] {
+                let png = encode_bands(&image, band, &options);
+                assert_eq!(
+                    decode(&png),
+                    image,
+                    "{}x{}, bands of {}",
+                    width,
+                    height,
+                    band
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn missing_rows() {
+        let image = gradient(8, 8).into_raw();
+        let mut encoder = PngEncoder::new(vec![], 8, 8, &PngOptions::default()).unwrap();
+        encoder.write_rows(&image[..8 * 4 * 5]).unwrap();
+        assert!(encoder.write_rows(&image[..8 * 4 * 4]).is_err());
+        assert!(encoder.write_rows(&image[..7]).is_err());
+        assert!(encoder.finish().is_err());
+    }
+
+    #[test]
+    fn filters_round_trip() {
+        // the gradient has too many colors for a palette
+        let images = [(gradient(61, 40), 6), (stripes(61, 40, 5), 3)];
+        for &filter in &FILTERS {
+            for &threads in &[1, 2] {
+                for &palette in &[false, true] {
+                    let options = PngOptions {
+                        filter,
+                        threads,
+                        palette,
+                        ..PngOptions::default()
+                    };
+                    for (image, indexed) in &images {
+                        let png = encode_png(image, vec![], &options).unwrap();
+                        let expected = if palette { *indexed } else { 6 };
+                        assert_eq!(color_type(&png), expected, "{:?}", options);
+                        assert_eq!(&decode(&png), image, "{:?}", options);
+                    }
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn palette_transparency() {
+        let options = PngOptions {
+            palette: true,
+            ..PngOptions::default()
+        };
+        // the last color is translucent, then opaque and left out of tRNS
+        for &colors in &[6, 5] {
+            let image = stripes(20, 10, colors);
+            let png = encode_png(&image, vec![], &options).unwrap();
+            assert!(has_chunk(&png, b"tRNS"));
+            assert_eq!(decode(&png), image);
+        }
+
+        let image = RgbaImage::from_fn(20, 10, |x, _| Rgba([x as u8 * 10, 0, 0, 255]));
+        let png = encode_png(&image, vec![], &options).unwrap();
+        assert_eq!(color_type(&png), 3);
+        assert!(!has_chunk(&png, b"tRNS"));
+        assert_eq!(decode(&png), image);
+    }
+
+    #[test]
+    fn parallel_chunks() {
+        // several chunks compressed at once, which end in the middle of rows
+        let images = [gradient(301, 500), stripes(601, 900, 5)];
+        for &threads in &[2, 3, 0] {
+            for &filter in &[FilterType::Sub, FilterType::Paeth] {
+                for &palette in &[false, true] {
+                    let options = PngOptions {
+                        filter,
+                        threads,
+                        palette,
+                        ..PngOptions::default()
+                    };
+                    for image in &images {
+                        let png = encode_png(image, vec![], &options).unwrap();
+                        assert_eq!(&decode(&png), image, "{:?}", options);
+                    }
+                }
+            }
+        }
+    }
+}
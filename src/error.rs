@@ -1,6 +1,7 @@
 use font_kit::error::{FontLoadingError, SelectionError};
 use std::error::Error;
 use std::fmt::{self, Display};
+use std::io;
 use std::num::ParseIntError;
 
 #[derive(Debug)]
@@ -54,3 +55,34 @@ impl From<ParseIntError> for ParseColorError {
         ParseColorError::InvalidDigit
     }
 }
+
+#[derive(Debug)]
+pub enum RenderError {
+    /// too many renders are pending
+    Busy,
+    UnknownLanguage(String),
+    Io(io::Error),
+    /// the render panicked
+    Panicked,
+}
+
+impl Error for RenderError {}
+
+impl Display for RenderError {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            RenderError::Busy => write!(f, "Too many pending renders"),
+            RenderError::UnknownLanguage(language) => {
+                write!(f, "Unsupported language: {}", language)
+            }
+            RenderError::Io(e) => write!(f, "Failed to encode the image: {}", e),
+            RenderError::Panicked => write!(f, "The render panicked"),
+        }
+    }
+}
+
+impl From<io::Error> for RenderError {
+    fn from(e: io::Error) -> Self {
+        RenderError::Io(e)
+    }
+}
@@ -12,18 +12,25 @@
 //! font.draw_text_mut(&mut image, Rgb([255, 0, 0]), 0, 0, FontStyle::REGULAR, "Hello, world");
 //! ```
 use crate::error::FontError;
+use crate::font_index::{self, IndexedFace};
+use crate::utils::lerp_pixel;
 use conv::ValueInto;
 use font_kit::canvas::{Canvas, Format, RasterizationOptions};
 use font_kit::font::Font;
+use font_kit::handle::Handle;
 use font_kit::hinting::HintingOptions;
 use font_kit::properties::{Properties, Style, Weight};
 use font_kit::source::SystemSource;
-use image::{GenericImage, Pixel};
+use image::{GenericImage, Pixel, Rgba};
 use imageproc::definitions::Clamp;
 use imageproc::pixelops::weighted_sum;
 use pathfinder_geometry::transform2d::Transform2F;
+use std::cell::RefCell;
 use std::collections::HashMap;
-use std::sync::Arc;
+use std::fmt;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, MutexGuard, PoisonError, Weak};
 use syntect::highlighting;
 
 /// Font style
@@ -62,9 +69,27 @@ pub struct ImageFont {
     pub size: f32,
 }
 
+/// Handles to open the faces of an `ImageFont` again, by style
+type FaceHandles = HashMap<FontStyle, Handle>;
+
+/// What an `ImageFont` was opened from
+#[derive(Default)]
+struct FontSource {
+    handles: FaceHandles,
+    /// the files of the faces, none for the builtin font
+    files: Vec<PathBuf>,
+}
+
 impl Default for ImageFont {
     /// It will use Hack font (size: 26.0) by default
     fn default() -> Self {
+        Self::builtin(26.0).0
+    }
+}
+
+impl ImageFont {
+    /// The builtin Hack font
+    fn builtin(size: f32) -> (Self, FontSource) {
         let l = vec![
             (
                 REGULAR,
@@ -84,27 +109,39 @@ impl Default for ImageFont {
             ),
         ];
         let mut fonts = HashMap::new();
+        let mut handles = HashMap::new();
         for (style, bytes) in l {
-            let font = Font::from_bytes(Arc::new(bytes), 0).unwrap();
+            let bytes = Arc::new(bytes);
+            let font = Font::from_bytes(bytes.clone(), 0).unwrap();
             fonts.insert(style, font);
+            handles.insert(style, Handle::from_memory(bytes, 0));
         }
 
-        Self { fonts, size: 26.0 }
+        let source = FontSource {
+            handles,
+            files: vec![],
+        };
+        (Self { fonts, size }, source)
     }
-}
 
-impl ImageFont {
     pub fn new(name: &str, size: f32) -> Result<Self, FontError> {
+        Self::open(name, size).map(|(font, _)| font)
+    }
+
+    /// Load the font, with where its faces were loaded from
+    fn open(name: &str, size: f32) -> Result<(Self, FontSource), FontError> {
         // Silicon already contains Hack font
         if name == "Hack" {
-            let font = ImageFont {
-                size,
-                ..Default::default()
-            };
-            return Ok(font);
+            return Ok(Self::builtin(size));
+        }
+
+        if let Some((fonts, source)) = Self::load_indexed(name) {
+            return Ok((Self { fonts, size }, source));
         }
 
         let mut fonts = HashMap::new();
+        let mut source = FontSource::default();
+        let mut faces = HashMap::new();
 
         let family = SystemSource::new().select_family_by_name(name)?;
         let handles = family.fonts();
@@ -119,30 +156,80 @@ impl ImageFont {
             debug!("{:?} - {:?}", font, properties);
 
             // cannot use match because `Weight` didn't derive `Eq`
-            match properties.style {
+            let style = match properties.style {
                 Style::Normal => {
                     if properties.weight == Weight::NORMAL {
-                        fonts.insert(REGULAR, font);
+                        Some(REGULAR)
                     } else if properties.weight == Weight::BOLD {
-                        fonts.insert(BOLD, font);
+                        Some(BOLD)
                     } else if properties.weight == Weight::MEDIUM && !fonts.contains_key(&REGULAR) {
-                        fonts.insert(REGULAR, font);
+                        Some(REGULAR)
+                    } else {
+                        None
                     }
                 }
                 Style::Italic => {
                     if properties.weight == Weight::NORMAL {
-                        fonts.insert(ITALIC, font);
+                        Some(ITALIC)
                     } else if properties.weight == Weight::BOLD {
-                        fonts.insert(BOLDITALIC, font);
+                        Some(BOLDITALIC)
                     } else if properties.weight == Weight::MEDIUM && !fonts.contains_key(&ITALIC) {
-                        fonts.insert(ITALIC, font);
+                        Some(ITALIC)
+                    } else {
+                        None
                     }
                 }
-                _ => (),
+                _ => None,
+            };
+
+            if let Some(style) = style {
+                if let Handle::Path { path, font_index } = handle {
+                    source.files.push(path.clone());
+                    let face = IndexedFace {
+                        style,
+                        path: path.clone(),
+                        font_index: *font_index,
+                    };
+                    faces.insert(style, face);
+                }
+                source.handles.insert(style, shared_handle(&font, handle));
+                fonts.insert(style, font);
             }
         }
 
-        Ok(Self { fonts, size })
+        // fonts loaded from memory cannot be opened again without the system source
+        if fonts.contains_key(&REGULAR) && faces.len() == fonts.len() {
+            font_index::store(
+                name,
+                &faces.into_iter().map(|(_, face)| face).collect::<Vec<_>>(),
+            );
+        }
+
+        Ok((Self { fonts, size }, source))
+    }
+
+    /// Open the faces saved in the font index, without enumerating the fonts of the system
+    fn load_indexed(name: &str) -> Option<(HashMap<FontStyle, Font>, FontSource)> {
+        let mut fonts = HashMap::new();
+        let mut source = FontSource::default();
+        for face in font_index::lookup(name)? {
+            match Font::from_path(&face.path, face.font_index) {
+                Ok(font) => {
+                    let handle = Handle::from_path(face.path.clone(), face.font_index);
+                    source.files.push(face.path);
+                    source
+                        .handles
+                        .insert(face.style, shared_handle(&font, &handle));
+                    fonts.insert(face.style, font);
+                }
+                Err(e) => {
+                    // the font may be removed, look up the family again
+                    debug!("Failed to open {}: {}", face.path.display(), e);
+                    return None;
+                }
+            }
+        }
+        Some((fonts, source))
     }
 
     /// Get a font by style. If there is no such a font, it will return the REGULAR font.
@@ -165,15 +252,75 @@ impl ImageFont {
     }
 }
 
+/// A handle to open the font again, sharing the data already loaded if possible
+fn shared_handle(font: &Font, handle: &Handle) -> Handle {
+    let font_index = match handle {
+        Handle::Path { font_index, .. } | Handle::Memory { font_index, .. } => *font_index,
+    };
+    match font.copy_font_data() {
+        Some(bytes) => Handle::from_memory(bytes, font_index),
+        None => handle.clone(),
+    }
+}
+
+/// The fonts of a `FontCollection` opened in a thread
+struct OpenedFonts {
+    id: usize,
+    /// dead once the collection is dropped
+    alive: Weak<()>,
+    fonts: Vec<ImageFont>,
+}
+
+thread_local! {
+    /// Fonts can't be moved to other threads, so each thread opens its own
+    static OPENED_FONTS: RefCell<Vec<OpenedFonts>> = RefCell::new(vec![]);
+}
+
 /// A collection of font
 ///
-/// It can be used to draw text on the image.
-#[derive(Debug)]
-pub struct FontCollection(Vec<ImageFont>);
+/// It can be used to draw text on the image. It can be shared between threads: the fonts
+/// are opened again, from the same data, by each thread which needs to look up a glyph
+/// which isn't in the cache yet.
+pub struct FontCollection {
+    /// the faces of each font, and its size
+    sources: Vec<(FaceHandles, f32)>,
+    /// the files which the fonts were loaded from
+    files: Vec<PathBuf>,
+    /// identifies the fonts opened for this collection in each thread
+    id: usize,
+    alive: Arc<()>,
+    /// metrics of the fonts, computed once
+    font_height: u32,
+    baseline: i32,
+    family_names: Vec<String>,
+    /// Glyph lookups and rasterized glyphs, shared by every draw call on this collection
+    cache: Mutex<GlyphCache>,
+}
+
+impl fmt::Debug for FontCollection {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("FontCollection")
+            .field("fonts", &self.family_names)
+            .field("size", &self.font_size())
+            .finish()
+    }
+}
 
 impl Default for FontCollection {
     fn default() -> Self {
-        Self(vec![ImageFont::default()])
+        Self::from_fonts(vec![ImageFont::builtin(26.0)])
+    }
+}
+
+impl Drop for FontCollection {
+    fn drop(&mut self) {
+        // the fonts opened by other threads are closed when they next use a collection
+        let id = self.id;
+        let _ = OPENED_FONTS.try_with(|opened| {
+            if let Ok(mut opened) = opened.try_borrow_mut() {
+                opened.retain(|fonts| fonts.id != id);
+            }
+        });
     }
 }
 
@@ -183,67 +330,194 @@ impl FontCollection {
         let mut fonts = vec![];
         for (name, size) in font_list {
             let name = name.as_ref();
-            match ImageFont::new(name, *size) {
+            match ImageFont::open(name, *size) {
                 Ok(font) => fonts.push(font),
                 Err(err) => eprintln!("[error] Error occurs when load font `{}`: {}", name, err),
             }
         }
-        Ok(Self(fonts))
+        Ok(Self::from_fonts(fonts))
+    }
+
+    fn from_fonts(fonts: Vec<(ImageFont, FontSource)>) -> Self {
+        static NEXT_ID: AtomicUsize = AtomicUsize::new(0);
+
+        let (fonts, sources): (Vec<_>, Vec<_>) = fonts.into_iter().unzip();
+        let (handles, files): (Vec<_>, Vec<_>) = sources
+            .into_iter()
+            .map(|source| (source.handles, source.files))
+            .unzip();
+        let font_height = fonts
+            .iter()
+            .map(|font| font.get_font_height())
+            .max()
+            .unwrap_or(0);
+        let baseline = fonts.first().map_or(0, |font| {
+            let metrics = font.get_regular().metrics();
+            let descent = (metrics.descent / metrics.units_per_em as f32 * font.size).round();
+            font_height as i32 + descent as i32
+        });
+
+        let collection = Self {
+            sources: handles
+                .into_iter()
+                .zip(fonts.iter().map(|font| font.size))
+                .collect(),
+            files: files.into_iter().flatten().collect(),
+            id: NEXT_ID.fetch_add(1, Ordering::Relaxed),
+            alive: Arc::new(()),
+            font_height,
+            baseline,
+            family_names: fonts
+                .iter()
+                .map(|font| font.get_regular().family_name())
+                .collect(),
+            cache: Mutex::new(GlyphCache::default()),
+        };
+        // they are already opened in this thread
+        collection.keep_opened(fonts);
+        collection
     }
 
-    fn glyph_for_char(&self, c: char, style: FontStyle) -> Option<(u32, &ImageFont, &Font)> {
-        for font in &self.0 {
-            let result = font.get_by_style(style);
-            if let Some(id) = result.glyph_for_char(c) {
-                return Some((id, font, result));
+    fn keep_opened(&self, fonts: Vec<ImageFont>) {
+        OPENED_FONTS.with(|opened| {
+            let mut opened = opened.borrow_mut();
+            opened.retain(|fonts| fonts.alive.strong_count() > 0);
+            opened.push(OpenedFonts {
+                id: self.id,
+                alive: Arc::downgrade(&self.alive),
+                fonts,
+            });
+        })
+    }
+
+    /// Call `f` with the fonts opened in this thread, opening them the first time
+    fn with_fonts<R, F: FnOnce(&[ImageFont]) -> R>(&self, f: F) -> Result<R, FontError> {
+        OPENED_FONTS.with(|opened| {
+            // the collections dropped on other threads can only be closed here
+            opened
+                .borrow_mut()
+                .retain(|fonts| fonts.alive.strong_count() > 0);
+
+            if !opened.borrow().iter().any(|fonts| fonts.id == self.id) {
+                let mut fonts = vec![];
+                for (handles, size) in &self.sources {
+                    let faces = handles
+                        .iter()
+                        .map(|(style, handle)| Ok((*style, handle.load()?)))
+                        .collect::<Result<_, FontError>>()?;
+                    fonts.push(ImageFont {
+                        fonts: faces,
+                        size: *size,
+                    });
+                }
+                self.keep_opened(fonts);
+            }
+
+            let opened = opened.borrow();
+            let fonts = opened.iter().find(|fonts| fonts.id == self.id).unwrap();
+            Ok(f(&fonts.fonts))
+        })
+    }
+
+    /// The glyph cache, which is only locked for each access so the threads which draw with
+    /// this collection don't wait for each other
+    fn cache(&self) -> MutexGuard<'_, GlyphCache> {
+        self.cache.lock().unwrap_or_else(PoisonError::into_inner)
+    }
+
+    /// Look up the glyph of a character, searching the fallback chain only on the first call
+    fn lookup(&self, c: char, style: FontStyle) -> Option<GlyphInfo> {
+        if let Some(info) = self.cache().chars[style as usize].get(c) {
+            return info.clone();
+        }
+
+        let info = match self.with_fonts(|fonts| self.find_glyph(fonts, c, style)) {
+            Ok(info) => info,
+            Err(e) => {
+                eprintln!("[error] Failed to open the fonts: {}", e);
+                None
+            }
+        };
+        if info.is_none() {
+            eprintln!("[warning] No font found for character `{}`", c);
+        }
+        self.cache().chars[style as usize].insert(c, info.clone());
+        info
+    }
+
+    /// Search the fallback chain for the glyph of a character, and rasterize it if it isn't
+    /// in the cache yet
+    fn find_glyph(&self, fonts: &[ImageFont], c: char, style: FontStyle) -> Option<GlyphInfo> {
+        for (index, imfont) in fonts.iter().enumerate() {
+            let font = imfont.get_by_style(style);
+            if let Some(id) = font.glyph_for_char(c) {
+                let key = GlyphKey {
+                    font: index,
+                    style,
+                    id,
+                    size: imfont.size.to_bits(),
+                };
+                let cached = self.cache().glyphs.get(&key).cloned();
+                let glyph = cached.unwrap_or_else(|| {
+                    // rasterized without the lock, another thread may have done it meanwhile
+                    let glyph = Arc::new(RasterizedGlyph::new(font, id, imfont.size));
+                    self.cache().glyphs.entry(key).or_insert(glyph).clone()
+                });
+                return Some(GlyphInfo {
+                    advance: Self::get_glyph_width(font, id, imfont.size),
+                    glyph,
+                });
             }
         }
-        eprintln!("[warning] No font found for character `{}`", c);
         None
     }
 
     /// get max height of all the fonts
     pub fn get_font_height(&self) -> u32 {
-        self.0
-            .iter()
-            .map(|font| font.get_font_height())
-            .max()
-            .unwrap()
+        self.font_height
+    }
+
+    /// The family names of the fonts, in the order of fallback
+    pub(crate) fn family_names(&self) -> Vec<String> {
+        self.family_names.clone()
+    }
+
+    /// The size of the first font
+    pub(crate) fn font_size(&self) -> f32 {
+        self.sources.first().map_or(0.0, |(_, size)| *size)
     }
 
-    fn layout(&self, text: &str, style: FontStyle) -> (Vec<PositionedGlyph>, u32) {
+    /// The distance from the top of a line to the baseline
+    pub(crate) fn get_baseline(&self) -> i32 {
+        self.baseline
+    }
+
+    /// Lay out the text at (x, y) and append its glyphs to `glyphs`.
+    /// return the width of the text
+    pub(crate) fn layout_into(
+        &self,
+        text: &str,
+        style: FontStyle,
+        x: u32,
+        y: u32,
+        glyphs: &mut Vec<PositionedGlyph>,
+    ) -> u32 {
         let mut delta_x = 0;
-        let height = self.get_font_height();
-
-        let glyphs = text
-            .chars()
-            .filter_map(|c| {
-                self.glyph_for_char(c, style).map(|(id, imfont, font)| {
-                    let raster_rect = font
-                        .raster_bounds(
-                            id,
-                            imfont.size,
-                            Transform2F::default(),
-                            HintingOptions::None,
-                            RasterizationOptions::GrayscaleAa,
-                        )
-                        .unwrap();
-                    let position =
-                        Vector2I::new(delta_x as i32, height as i32) + raster_rect.origin();
-                    delta_x += Self::get_glyph_width(font, id, imfont.size);
-
-                    PositionedGlyph {
-                        id,
-                        font: font.clone(),
-                        size: imfont.size,
-                        raster_rect,
-                        position,
-                    }
-                })
-            })
-            .collect();
+        let baseline = y as i32 + self.get_baseline();
+        for c in text.chars() {
+            if let Some(info) = self.lookup(c, style) {
+                let position =
+                    Vector2I::new((x + delta_x) as i32, baseline) + info.glyph.rect.origin();
+                delta_x += info.advance;
+
+                glyphs.push(PositionedGlyph {
+                    glyph: info.glyph,
+                    position,
+                });
+            }
+        }
 
-        (glyphs, delta_x)
+        delta_x
     }
 
     /// Get the width of the given glyph
@@ -255,7 +529,10 @@ impl FontCollection {
 
     /// Get the width of the given text
     pub fn get_text_len(&self, text: &str) -> u32 {
-        self.layout(text, REGULAR).1
+        text.chars()
+            .filter_map(|c| self.lookup(c, REGULAR))
+            .map(|info| info.advance)
+            .sum()
     }
 
     /// Draw the text to a image
@@ -273,63 +550,235 @@ impl FontCollection {
         I: GenericImage,
         <I::Pixel as Pixel>::Subpixel: ValueInto<f32> + Clamp<f32>,
     {
-        let metrics = self.0[0].get_regular().metrics();
-        let offset =
-            (metrics.descent / metrics.units_per_em as f32 * self.0[0].size).round() as i32;
+        let mut glyphs = vec![];
+        let width = self.layout_into(text, style, x, y, &mut glyphs);
+        draw_glyphs_mut(image, color, &glyphs);
 
-        let (glyphs, width) = self.layout(text, style);
+        width
+    }
+}
+
+/// Draw glyphs to a band of a RGBA image, blending whole rows in the raw buffer.
+///
+/// `band` is the raw buffer of the rows starting at `top` of an image of given width,
+/// the glyphs are moved by `columns.0` pixels to the right and clipped to the columns
+/// `columns.0..columns.1`.
+pub(crate) fn draw_glyphs_band(
+    band: &mut [u8],
+    width: u32,
+    columns: (u32, u32),
+    top: u32,
+    color: Rgba<u8>,
+    glyphs: &[PositionedGlyph],
+) {
+    let stride = width as usize * 4;
+    if stride == 0 {
+        return;
+    }
+    let rows = (band.len() / stride) as i32;
+    let color = u32::from_ne_bytes(color.0);
+    let (first, end) = (columns.0 as i32, columns.1.min(width) as i32);
+
+    for glyph in glyphs {
+        let rect = glyph.glyph.rect;
+        let (x0, y0) = (glyph.position.x() + first, glyph.position.y() - top as i32);
+
+        // the visible columns and rows of the glyph
+        let (left, right) = ((first - x0).max(0), (end - x0).min(rect.width()));
+        let (upper, lower) = ((-y0).max(0), (rows - y0).min(rect.height()));
+
+        for y in upper..lower {
+            let (start, end) = glyph.glyph.spans[y as usize];
+            let (start, end) = ((start as i32).max(left), (end as i32).min(right));
+            if start >= end {
+                continue;
+            }
 
-        for glyph in glyphs {
-            glyph.draw(offset, |px, py, v| {
-                if v <= std::f32::EPSILON {
-                    return;
+            let row_start = y as usize * glyph.glyph.stride;
+            let coverage =
+                &glyph.glyph.pixels[row_start + start as usize..row_start + end as usize];
+            let offset = (y0 + y) as usize * stride + (x0 + start) as usize * 4;
+            let dst = &mut band[offset..offset + coverage.len() * 4];
+
+            for (pixel, &v) in dst.chunks_exact_mut(4).zip(coverage) {
+                match v {
+                    0 => (),
+                    255 => pixel.copy_from_slice(&color.to_ne_bytes()),
+                    _ => {
+                        let d = u32::from_ne_bytes([pixel[0], pixel[1], pixel[2], pixel[3]]);
+                        pixel.copy_from_slice(&lerp_pixel(d, color, v).to_ne_bytes());
+                    }
                 }
-                let (x, y) = ((px + x as i32) as u32, (py + y as i32) as u32);
-                let pixel = image.get_pixel(x, y);
-                let weighted_color = weighted_sum(pixel, color, 1.0 - v, v);
-                image.put_pixel(x, y, weighted_color);
-            })
+            }
         }
+    }
+}
 
-        width
+/// Draw glyphs laid out by `FontCollection::layout_into` to a image
+pub(crate) fn draw_glyphs_mut<I>(image: &mut I, color: I::Pixel, glyphs: &[PositionedGlyph])
+where
+    I: GenericImage,
+    <I::Pixel as Pixel>::Subpixel: ValueInto<f32> + Clamp<f32>,
+{
+    for glyph in glyphs {
+        glyph.draw(|x, y, v| {
+            if v <= std::f32::EPSILON {
+                return;
+            }
+            let (x, y) = (x as u32, y as u32);
+            let pixel = image.get_pixel(x, y);
+            let weighted_color = weighted_sum(pixel, color, 1.0 - v, v);
+            image.put_pixel(x, y, weighted_color);
+        })
     }
 }
 
-struct PositionedGlyph {
+/// Identify a rasterized glyph in the cache of a `FontCollection`
+#[derive(Copy, Clone, Debug, Eq, PartialEq, Hash)]
+struct GlyphKey {
+    /// index of the `ImageFont` in the collection
+    font: usize,
+    style: FontStyle,
     id: u32,
-    font: Font,
-    size: f32,
-    position: Vector2I,
-    raster_rect: RectI,
+    /// bits of the `f32` font size
+    size: u32,
 }
 
-impl PositionedGlyph {
-    fn draw<O: FnMut(i32, i32, f32)>(&self, offset: i32, mut o: O) {
-        let mut canvas = Canvas::new(self.raster_rect.size(), Format::A8);
+/// The result of looking up a character in a `FontCollection`
+#[derive(Clone, Debug)]
+struct GlyphInfo {
+    /// horizontal advance in pixels
+    advance: u32,
+    glyph: Arc<RasterizedGlyph>,
+}
+
+/// Memoized character lookups of one font style, including the misses
+#[derive(Debug)]
+struct CharTable {
+    /// dense table for ASCII characters, `None` means not looked up yet
+    ascii: Vec<Option<Option<GlyphInfo>>>,
+    others: HashMap<char, Option<GlyphInfo>>,
+}
+
+impl Default for CharTable {
+    fn default() -> Self {
+        Self {
+            ascii: vec![None; 128],
+            others: HashMap::new(),
+        }
+    }
+}
+
+impl CharTable {
+    fn get(&self, c: char) -> Option<&Option<GlyphInfo>> {
+        if c.is_ascii() {
+            self.ascii[c as usize].as_ref()
+        } else {
+            self.others.get(&c)
+        }
+    }
+
+    fn insert(&mut self, c: char, info: Option<GlyphInfo>) {
+        if c.is_ascii() {
+            self.ascii[c as usize] = Some(info);
+        } else {
+            self.others.insert(c, info);
+        }
+    }
+}
+
+#[derive(Debug, Default)]
+struct GlyphCache {
+    /// rasterized glyphs
+    glyphs: HashMap<GlyphKey, Arc<RasterizedGlyph>>,
+    /// character lookups, indexed by `FontStyle`
+    chars: [CharTable; 4],
+}
+
+/// The A8 coverage bitmap of a glyph
+#[derive(Debug)]
+struct RasterizedGlyph {
+    /// raster bounds of the glyph, relative to the pen position
+    rect: RectI,
+    stride: usize,
+    pixels: Vec<u8>,
+    /// the columns with non-zero coverage of each row, as `start..end`
+    spans: Vec<(u32, u32)>,
+}
+
+impl RasterizedGlyph {
+    fn new(font: &Font, id: u32, size: f32) -> Self {
+        let rect = font
+            .raster_bounds(
+                id,
+                size,
+                Transform2F::default(),
+                HintingOptions::None,
+                RasterizationOptions::GrayscaleAa,
+            )
+            .unwrap();
+        let mut canvas = Canvas::new(rect.size(), Format::A8);
 
         // don't rasterize whitespace(https://github.com/pcwalton/font-kit/issues/7)
         if canvas.size != Vector2I::new(0, 0) {
-            self.font
-                .rasterize_glyph(
-                    &mut canvas,
-                    self.id,
-                    self.size,
-                    Transform2F::from_translation(-self.raster_rect.origin().to_f32()),
-                    HintingOptions::None,
-                    RasterizationOptions::GrayscaleAa,
-                )
-                .unwrap();
+            font.rasterize_glyph(
+                &mut canvas,
+                id,
+                size,
+                Transform2F::from_translation(-rect.origin().to_f32()),
+                HintingOptions::None,
+                RasterizationOptions::GrayscaleAa,
+            )
+            .unwrap();
         }
 
-        for y in (0..self.raster_rect.height()).rev() {
-            let (row_start, row_end) =
-                (y as usize * canvas.stride, (y + 1) as usize * canvas.stride);
-            let row = &canvas.pixels[row_start..row_end];
+        let spans = (0..rect.height() as usize)
+            .map(|y| {
+                let row = &canvas.pixels[y * canvas.stride..][..rect.width() as usize];
+                match row.iter().position(|&v| v != 0) {
+                    Some(start) => {
+                        let end = row.iter().rposition(|&v| v != 0).unwrap() + 1;
+                        (start as u32, end as u32)
+                    }
+                    None => (0, 0),
+                }
+            })
+            .collect();
+
+        Self {
+            rect,
+            stride: canvas.stride,
+            pixels: canvas.pixels,
+            spans,
+        }
+    }
+}
+
+/// A glyph placed in the image
+#[derive(Clone, Debug)]
+pub(crate) struct PositionedGlyph {
+    glyph: Arc<RasterizedGlyph>,
+    /// the top left corner of the glyph bitmap
+    position: Vector2I,
+}
+
+impl PositionedGlyph {
+    /// Move the glyph horizontally
+    pub(crate) fn shift_x(&mut self, dx: i32) {
+        self.position = self.position + Vector2I::new(dx, 0);
+    }
+
+    fn draw<O: FnMut(i32, i32, f32)>(&self, mut o: O) {
+        let rect = self.glyph.rect;
+
+        for y in 0..rect.height() {
+            let row_start = y as usize * self.glyph.stride;
+            let row = &self.glyph.pixels[row_start..row_start + rect.width() as usize];
 
-            for x in 0..self.raster_rect.width() {
-                let val = f32::from(row[x as usize]) / 255.0;
-                let px = self.position.x() + x;
-                let py = self.position.y() + y + offset;
+            for (x, &val) in row.iter().enumerate() {
+                let val = f32::from(val) / 255.0;
+                let px = self.position.x() + x as i32;
+                let py = self.position.y() + y;
 
                 o(px, py, val);
             }
@@ -0,0 +1,175 @@
+//! A persistent index of the fonts chosen for each family
+//!
+//! Selecting a family with `SystemSource` enumerates every installed font, which is slow
+//! when there are thousands of them. So the faces chosen for a family are saved in the
+//! cache directory, until one of the font directories, or a directory in them, is modified.
+use crate::directories::PROJECT_DIRS;
+use crate::font::FontStyle;
+use lazy_static::lazy_static;
+use std::collections::hash_map::DefaultHasher;
+use std::fs;
+use std::hash::{Hash, Hasher};
+use std::path::PathBuf;
+use std::time::SystemTime;
+
+const INDEX_FILE: &str = "silicon-fonts.idx";
+
+/// A font face saved in the index
+#[derive(Debug, Clone)]
+pub(crate) struct IndexedFace {
+    pub style: FontStyle,
+    pub path: PathBuf,
+    pub font_index: u32,
+}
+
+/// The directories which contain the fonts of the system
+fn font_dirs() -> Vec<PathBuf> {
+    let mut paths = vec![];
+
+    #[cfg(target_os = "macos")]
+    paths.extend(
+        ["/System/Library/Fonts", "/Library/Fonts"]
+            .iter()
+            .map(PathBuf::from),
+    );
+
+    #[cfg(target_os = "windows")]
+    paths.extend(
+        std::env::var_os("WINDIR")
+            .map(|dir| PathBuf::from(dir).join("Fonts"))
+            .into_iter()
+            .chain(dirs::data_local_dir().map(|dir| dir.join("Microsoft/Windows/Fonts"))),
+    );
+
+    #[cfg(not(any(target_os = "macos", target_os = "windows")))]
+    paths.extend(
+        ["/usr/share/fonts", "/usr/local/share/fonts", "/etc/fonts"]
+            .iter()
+            .map(PathBuf::from)
+            .chain(dirs::home_dir().map(|dir| dir.join(".fonts"))),
+    );
+
+    paths.extend(dirs::font_dir());
+    paths
+}
+
+lazy_static! {
+    /// The stamp of the font directories, they are only walked once by a process
+    static ref STAMP: u64 = stamp();
+}
+
+/// A fingerprint of the modification time of the font directories and of every directory
+/// in them
+fn stamp() -> u64 {
+    let mut hasher = DefaultHasher::new();
+    let mut dirs = font_dirs();
+    while let Some(dir) = dirs.pop() {
+        let mtime = fs::metadata(&dir)
+            .and_then(|metadata| metadata.modified())
+            .ok()
+            .and_then(|time| time.duration_since(SystemTime::UNIX_EPOCH).ok());
+        dir.hash(&mut hasher);
+        mtime.hash(&mut hasher);
+
+        // the links aren't followed, so a link to a parent can't make a loop
+        let mut subdirs = fs::read_dir(&dir)
+            .map(|entries| {
+                entries
+                    .filter_map(Result::ok)
+                    .filter(|entry| entry.file_type().map_or(false, |kind| kind.is_dir()))
+                    .map(|entry| entry.path())
+                    .collect::<Vec<_>>()
+            })
+            .unwrap_or_default();
+        // walked in order, so the stamp doesn't depend on the order of `read_dir`
+        subdirs.sort_unstable_by(|a, b| b.cmp(a));
+        dirs.extend(subdirs);
+    }
+    hasher.finish()
+}
+
+fn parse_style(s: &str) -> Option<FontStyle> {
+    match s {
+        "REGULAR" => Some(FontStyle::REGULAR),
+        "ITALIC" => Some(FontStyle::ITALIC),
+        "BOLD" => Some(FontStyle::BOLD),
+        "BOLDITALIC" => Some(FontStyle::BOLDITALIC),
+        _ => None,
+    }
+}
+
+/// Read the `(family, face)` pairs of the index, if it's still valid
+fn read_index(stamp: u64) -> Vec<(String, IndexedFace)> {
+    let content = match fs::read_to_string(PROJECT_DIRS.cache_dir().join(INDEX_FILE)) {
+        Ok(content) => content,
+        Err(_) => return vec![],
+    };
+    let mut lines = content.lines();
+    if lines.next() != Some(&stamp.to_string()[..]) {
+        return vec![];
+    }
+
+    lines
+        .filter_map(|line| {
+            let mut fields = line.splitn(4, '\t');
+            let family = fields.next()?.to_owned();
+            let style = parse_style(fields.next()?)?;
+            let font_index = fields.next()?.parse().ok()?;
+            let path = PathBuf::from(fields.next()?);
+            Some((
+                family,
+                IndexedFace {
+                    style,
+                    path,
+                    font_index,
+                },
+            ))
+        })
+        .collect()
+}
+
+/// Get the faces saved for the family
+pub(crate) fn lookup(family: &str) -> Option<Vec<IndexedFace>> {
+    let faces = read_index(*STAMP)
+        .into_iter()
+        .filter(|(name, _)| name == family)
+        .map(|(_, face)| face)
+        .collect::<Vec<_>>();
+
+    if faces.is_empty() {
+        None
+    } else {
+        Some(faces)
+    }
+}
+
+/// Save the faces chosen for the family
+pub(crate) fn store(family: &str, faces: &[IndexedFace]) {
+    let stamp = *STAMP;
+    let mut content = format!("{}\n", stamp);
+
+    let others = read_index(stamp)
+        .into_iter()
+        .filter(|(name, _)| name != family);
+    let faces = faces.iter().map(|face| (family.to_owned(), face.clone()));
+    for (name, face) in others.chain(faces) {
+        content.push_str(&format!(
+            "{}\t{:?}\t{}\t{}\n",
+            name,
+            face.style,
+            face.font_index,
+            face.path.display()
+        ));
+    }
+
+    // write to a temporary file first so that other processes never read a partial index
+    let cache_dir = PROJECT_DIRS.cache_dir();
+    let temp = cache_dir.join(format!("{}.{}", INDEX_FILE, std::process::id()));
+    let result = fs::create_dir_all(cache_dir)
+        .and_then(|_| fs::write(&temp, content))
+        .and_then(|_| fs::rename(&temp, cache_dir.join(INDEX_FILE)));
+    if let Err(e) = result {
+        debug!("Failed to save the font index: {}", e);
+        let _ = fs::remove_file(&temp);
+    }
+}
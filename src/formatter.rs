@@ -1,9 +1,27 @@
 //! Format the output of syntect into an image
+use crate::encoder::{encode_png, PngEncoder, PngOptions};
 use crate::error::FontError;
-use crate::font::{FontCollection, FontStyle};
+use crate::font::{draw_glyphs_band, FontCollection, FontStyle, PositionedGlyph};
+use crate::profile::{time, Profiler};
+use crate::svg;
 use crate::utils::*;
-use image::{DynamicImage, GenericImageView, Rgba, RgbaImage};
-use syntect::highlighting::{Color, Style, Theme};
+use image::{DynamicImage, Rgba, RgbaImage};
+use rayon::prelude::*;
+use rayon::{ThreadPool, ThreadPoolBuilder};
+use std::fmt::Write as _;
+use std::io::{self, Write};
+use std::path::PathBuf;
+use std::sync::Arc;
+use syntect::highlighting::{Style, Theme};
+
+/// Number of rows of the bands in which `format_png` draws the image
+const BAND_ROWS: u32 = 256;
+
+/// Radius of the round corners
+const CORNER_RADIUS: u32 = 12;
+
+/// Color out of the round corners, when the code image is not drawn onto the background
+const TRANSPARENT: Rgba<u8> = Rgba([255, 255, 255, 0]);
 
 pub struct ImageFormatter {
     /// pad between lines
@@ -24,9 +42,6 @@ pub struct ImageFormatter {
     /// pad between code and line number
     /// Default: 6
     line_number_pad: u32,
-    /// number of columns of line number area
-    /// Default: Auto detect
-    line_number_chars: u32,
     /// font of english character, should be mono space font
     /// Default: Hack (builtin)
     font: FontCollection,
@@ -38,9 +53,19 @@ pub struct ImageFormatter {
     tab_width: u8,
     /// Line Offset
     line_offset: u32,
+    /// Thread pool used to draw the code, `None` if it is drawn on a single thread. The global
+    /// pool is used if the pool couldn't be created.
+    /// Default: None
+    thread_pool: Option<Arc<ThreadPool>>,
+    /// Number of threads used to draw the code, 0 means all cores
+    /// Default: 1
+    threads: usize,
+    /// Options of the PNG encoder used by `format_png`
+    png_options: PngOptions,
+    /// Called with the time spent in each stage
+    profiler: Option<Profiler>,
 }
 
-#[derive(Default)]
 pub struct ImageFormatterBuilder<S> {
     /// Pad between lines
     line_pad: u32,
@@ -60,20 +85,38 @@ pub struct ImageFormatterBuilder<S> {
     tab_width: u8,
     /// Line Offset
     line_offset: u32,
+    /// Number of threads used to draw the code
+    threads: usize,
+    /// Options of the PNG encoder
+    png_options: PngOptions,
+    /// Profiler of the stages of the render
+    profiler: Option<Profiler>,
 }
 
-// FIXME: cannot use `ImageFormatterBuilder::new().build()` bacuse cannot infer type for `S`
-impl<S: AsRef<str> + Default> ImageFormatterBuilder<S> {
-    pub fn new() -> Self {
+impl<S> Default for ImageFormatterBuilder<S> {
+    fn default() -> Self {
         Self {
             line_pad: 2,
             line_number: true,
+            font: vec![],
+            highlight_lines: vec![],
             window_controls: true,
             round_corner: true,
+            shadow_adder: None,
             tab_width: 4,
-            ..Default::default()
+            line_offset: 0,
+            threads: 1,
+            png_options: PngOptions::default(),
+            profiler: None,
         }
     }
+}
+
+// FIXME: cannot use `ImageFormatterBuilder::new().build()` bacuse cannot infer type for `S`
+impl<S: AsRef<str> + Default> ImageFormatterBuilder<S> {
+    pub fn new() -> Self {
+        Self::default()
+    }
 
     /// Whether show the line number
     pub fn line_number(mut self, show: bool) -> Self {
@@ -129,21 +172,55 @@ impl<S: AsRef<str> + Default> ImageFormatterBuilder<S> {
         self
     }
 
+    /// Set the number of threads used to draw the code, 0 means all cores.
+    ///
+    /// The image is split into horizontal bands which are drawn in parallel, on a pool of
+    /// the formatter.
+    pub fn threads(mut self, threads: usize) -> Self {
+        self.threads = threads;
+        self
+    }
+
+    /// Set the options of the PNG encoder
+    pub fn png_options(mut self, options: PngOptions) -> Self {
+        self.png_options = options;
+        self
+    }
+
+    /// Set the profiler which is called at the end of each stage of the render
+    pub fn profiler(mut self, profiler: Profiler) -> Self {
+        self.profiler = Some(profiler);
+        self
+    }
+
     pub fn build(self) -> Result<ImageFormatter, FontError> {
-        let font = if self.font.is_empty() {
-            FontCollection::default()
-        } else {
-            FontCollection::new(&self.font)?
-        };
+        let font = time(self.profiler.as_ref(), "load_fonts", || {
+            if self.font.is_empty() {
+                Ok(FontCollection::default())
+            } else {
+                FontCollection::new(&self.font)
+            }
+        })?;
 
         let code_pad_top = if self.window_controls { 50 } else { 0 };
 
+        // rayon sizes a pool of 0 threads to the number of cores
+        let thread_pool = if self.threads != 1 {
+            ThreadPoolBuilder::new()
+                .num_threads(self.threads)
+                .build()
+                .map_err(|e| eprintln!("[error] Failed to create thread pool: {}", e))
+                .ok()
+                .map(Arc::new)
+        } else {
+            None
+        };
+
         Ok(ImageFormatter {
             line_pad: self.line_pad,
             code_pad: 25,
             line_number: self.line_number,
             line_number_pad: 6,
-            line_number_chars: 0,
             highlight_lines: self.highlight_lines,
             round_corner: self.round_corner,
             shadow_adder: self.shadow_adder,
@@ -151,17 +228,122 @@ impl<S: AsRef<str> + Default> ImageFormatterBuilder<S> {
             code_pad_top,
             font,
             line_offset: self.line_offset,
+            thread_pool,
+            threads: self.threads,
+            png_options: self.png_options,
+            profiler: self.profiler,
         })
     }
 }
 
-struct Drawable {
+/// Max number of pixel buffers kept by a `RenderContext`
+const MAX_BUFFERS: usize = 4;
+
+/// Buffers kept between renders, so that rendering again with the same context allocates
+/// almost nothing.
+///
+/// The images returned by the formatter can be given back with `recycle` once they are
+/// saved, so that their buffers are used by the next render.
+#[derive(Default)]
+pub struct RenderContext {
+    /// pixel buffers of images
+    buffers: Vec<Vec<u8>>,
+    glyphs: Vec<PositionedGlyph>,
+    runs: Vec<Run>,
+}
+
+impl RenderContext {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Give back an image, its buffer will be used by the next images
+    pub fn recycle(&mut self, image: DynamicImage) {
+        self.recycle_image(image.into_rgba8());
+    }
+
+    pub(crate) fn recycle_image(&mut self, image: RgbaImage) {
+        self.buffers.push(image.into_raw());
+        if self.buffers.len() > MAX_BUFFERS {
+            // keep the biggest ones
+            let smallest = (0..self.buffers.len())
+                .min_by_key(|&i| self.buffers[i].capacity())
+                .unwrap();
+            self.buffers.swap_remove(smallest);
+        }
+    }
+
+    /// An image filled with the color, in a recycled buffer if there is one
+    pub(crate) fn image(&mut self, width: u32, height: u32, color: Rgba<u8>) -> RgbaImage {
+        let len = width as usize * height as usize * 4;
+        // the smallest buffer which is big enough, otherwise the biggest one
+        let best = (0..self.buffers.len())
+            .filter(|&i| self.buffers[i].capacity() >= len)
+            .min_by_key(|&i| self.buffers[i].capacity())
+            .or_else(|| (0..self.buffers.len()).max_by_key(|&i| self.buffers[i].capacity()));
+
+        let mut buffer = match best {
+            Some(i) => self.buffers.swap_remove(i),
+            None => Vec::new(),
+        };
+        buffer.resize(len, 0);
+        for pixel in buffer.chunks_exact_mut(4) {
+            pixel.copy_from_slice(&color.0);
+        }
+        RgbaImage::from_raw(width, height, buffer).unwrap()
+    }
+
+    /// Keep the glyphs and the runs of the drawables for the next layout
+    pub(crate) fn recycle_drawables(&mut self, drawables: Drawable) {
+        self.glyphs = drawables.glyphs;
+        self.runs = drawables.runs;
+    }
+}
+
+/// A run of glyphs with the same color
+struct Run {
+    color: Rgba<u8>,
+    /// the line where the glyphs are
+    line: u32,
+    /// range of the glyphs of this run
+    start: usize,
+    end: usize,
+}
+
+pub(crate) struct Drawable {
     /// max width of the picture
-    max_width: u32,
+    pub(crate) max_width: u32,
     /// max number of line of the picture
-    max_lineno: u32,
-    /// arguments for draw_text_mut
-    drawables: Vec<(u32, u32, Color, FontStyle, String)>,
+    pub(crate) max_lineno: u32,
+    /// glyphs of the code and line numbers, positioned in the image
+    glyphs: Vec<PositionedGlyph>,
+    /// color of the glyphs, in the order of lines
+    runs: Vec<Run>,
+    /// Y coordinate of the first line
+    line_top: u32,
+    /// height of a line
+    line_height: u32,
+    /// number of columns of the line numbers
+    line_number_chars: u32,
+}
+
+impl Drawable {
+    /// Draw the glyphs to the band of the image which starts at the row `top`
+    fn draw_band(&self, band: &mut [u8], width: u32, columns: (u32, u32), top: u32) {
+        let bottom = top + (band.len() / (width as usize * 4)) as u32;
+        // glyphs may be a little higher than lines, so draw the line around the band also
+        let first = (top.saturating_sub(self.line_top) / self.line_height).saturating_sub(1);
+        let last = bottom.saturating_sub(self.line_top) / self.line_height + 1;
+
+        let first_run = self.runs.partition_point(|run| run.line < first);
+        for run in self.runs[first_run..]
+            .iter()
+            .take_while(|run| run.line <= last)
+        {
+            let glyphs = &self.glyphs[run.start..run.end];
+            draw_glyphs_band(band, width, columns, top, run.color, glyphs);
+        }
+    }
 }
 
 impl ImageFormatter {
@@ -171,12 +353,12 @@ impl ImageFormatter {
     }
 
     /// calculate the Y coordinate of a line
-    fn get_line_y(&self, lineno: u32) -> u32 {
+    pub(crate) fn get_line_y(&self, lineno: u32) -> u32 {
         lineno * self.get_line_height() + self.code_pad + self.code_pad_top
     }
 
     /// calculate the size of code area
-    fn get_image_size(&self, max_width: u32, lineno: u32) -> (u32, u32) {
+    pub(crate) fn get_image_size(&self, max_width: u32, lineno: u32) -> (u32, u32) {
         (
             (max_width + self.code_pad).max(150),
             self.get_line_y(lineno + 1) + self.code_pad,
@@ -184,146 +366,794 @@ impl ImageFormatter {
     }
 
     /// Calculate where code start
-    fn get_left_pad(&self) -> u32 {
+    fn get_left_pad(&self, line_number_chars: u32) -> u32 {
         self.code_pad
             + if self.line_number {
-                let tmp = format!("{:>width$}", 0, width = self.line_number_chars as usize);
+                let tmp = format!("{:>width$}", 0, width = line_number_chars as usize);
                 2 * self.line_number_pad + self.font.get_text_len(&tmp)
             } else {
                 0
             }
     }
 
-    /// create
-    fn create_drawables(&self, v: &[Vec<(Style, &str)>]) -> Drawable {
+    /// Lay out a token at (x, y), with the tabs replaced by `tab`, return its width
+    fn layout_token(
+        &self,
+        text: &str,
+        style: FontStyle,
+        x: u32,
+        y: u32,
+        tab: &str,
+        glyphs: &mut Vec<PositionedGlyph>,
+    ) -> u32 {
+        let mut width = 0;
+        for (i, part) in text.split('\t').enumerate() {
+            if i != 0 {
+                width += self.font.layout_into(tab, style, x + width, y, glyphs);
+            }
+            width += self.font.layout_into(part, style, x + width, y, glyphs);
+        }
+        width
+    }
+
+    /// lay out the code and line numbers
+    ///
+    /// The lines are laid out as they come, the width of line numbers is only known at the
+    /// end, so the code is moved to the right of them afterwards.
+    pub(crate) fn create_drawables<I, L, S>(
+        &self,
+        lines: I,
+        foreground: Rgba<u8>,
+        context: &mut RenderContext,
+    ) -> Drawable
+    where
+        I: IntoIterator<Item = L>,
+        L: AsRef<[(Style, S)]>,
+        S: AsRef<str>,
+    {
         // tab should be replaced to whitespace so that it can be rendered correctly
         let tab = " ".repeat(self.tab_width as usize);
-        let mut drawables = vec![];
-        let (mut max_width, mut max_lineno) = (0, 0);
+        let mut glyphs = std::mem::take(&mut context.glyphs);
+        let mut runs = std::mem::take(&mut context.runs);
+        glyphs.clear();
+        runs.clear();
+        let mut max_width = None;
+        let mut count = 0;
 
-        for (i, tokens) in v.iter().enumerate() {
-            let height = self.get_line_y(i as u32);
-            let mut width = self.get_left_pad();
+        for (i, tokens) in lines.into_iter().enumerate() {
+            let line = i as u32;
+            let height = self.get_line_y(line);
+            let mut width = 0;
 
-            for (style, text) in tokens {
-                let text = text.trim_end_matches('\n').replace('\t', &tab);
+            for (style, text) in tokens.as_ref() {
+                let text = text.as_ref().trim_end_matches('\n');
                 if text.is_empty() {
                     continue;
                 }
 
-                drawables.push((
-                    width,
-                    height,
-                    style.foreground,
-                    style.font_style.into(),
-                    text.to_owned(),
-                ));
+                let start = glyphs.len();
+                let font_style = style.font_style.into();
+                width += self.layout_token(text, font_style, width, height, &tab, &mut glyphs);
+                runs.push(Run {
+                    color: style.foreground.to_rgba(),
+                    line,
+                    start,
+                    end: glyphs.len(),
+                });
+
+                max_width = max_width.max(Some(width));
+            }
+            count = i + 1;
+        }
+
+        let line_number_chars = if self.line_number {
+            (((count + self.line_offset as usize) as f32).log10() + 1.0).floor() as u32
+        } else {
+            0
+        };
+
+        let left_pad = self.get_left_pad(line_number_chars);
+        for glyph in &mut glyphs {
+            glyph.shift_x(left_pad as i32);
+        }
 
-                width += self.font.get_text_len(&text);
+        if self.line_number {
+            let number_color = line_number_color(foreground);
 
-                max_width = max_width.max(width);
+            // there is always a line number, even if there is no code
+            for line in 0..count.max(1) as u32 {
+                let line_mumber = format!(
+                    "{:>width$}",
+                    line + self.line_offset,
+                    width = line_number_chars as usize
+                );
+                let start = glyphs.len();
+                self.font.layout_into(
+                    &line_mumber,
+                    FontStyle::REGULAR,
+                    self.code_pad,
+                    self.get_line_y(line),
+                    &mut glyphs,
+                );
+                runs.push(Run {
+                    color: number_color,
+                    line,
+                    start,
+                    end: glyphs.len(),
+                });
             }
-            max_lineno = i as u32;
+            // the runs of code and line numbers are both sorted, merge them
+            runs.sort_by_key(|run| run.line);
         }
 
         Drawable {
-            max_width,
-            max_lineno,
-            drawables,
+            max_width: max_width.map_or(0, |width| width + left_pad),
+            max_lineno: count.max(1) as u32 - 1,
+            glyphs,
+            runs,
+            line_top: self.get_line_y(0),
+            line_height: self.get_line_height(),
+            line_number_chars,
         }
     }
 
-    fn draw_line_number(&self, image: &mut DynamicImage, lineno: u32, mut color: Rgba<u8>) {
-        for i in color.0.iter_mut() {
-            *i = (*i).saturating_sub(20);
+    /// Draw the glyphs to the band of the image which starts at the row `top` of the code,
+    /// in the columns `columns`, in parallel if it is enabled
+    fn draw_code(&self, band: &mut Rows<'_>, columns: (u32, u32), top: u32, drawables: &Drawable) {
+        let width = band.width();
+        if self.threads == 1 {
+            drawables.draw_band(band, width, columns, top);
+            return;
         }
-        for i in 0..=lineno {
-            let line_mumber = format!(
-                "{:>width$}",
-                i + self.line_offset,
-                width = self.line_number_chars as usize
-            );
-            self.font.draw_text_mut(
-                image,
-                color,
-                self.code_pad,
-                self.get_line_y(i),
-                FontStyle::REGULAR,
-                &line_mumber,
-            );
+
+        let mut draw = || {
+            // several bands per thread to balance the load
+            let bands = rayon::current_num_threads() as u32 * 4;
+            let rows = ((band.height() + bands - 1) / bands).max(drawables.line_height);
+            band.par_chunks_mut((rows * width * 4) as usize)
+                .enumerate()
+                .for_each(|(i, chunk)| {
+                    drawables.draw_band(chunk, width, columns, top + i as u32 * rows)
+                });
+        };
+        match &self.thread_pool {
+            Some(pool) => pool.install(draw),
+            None => draw(),
         }
     }
 
-    fn highlight_lines<I: IntoIterator<Item = u32>>(&self, image: &mut DynamicImage, lines: I) {
-        let width = image.width();
-        let height = self.font.get_font_height() + self.line_pad;
-        let mut color = image.get_pixel(20, 20);
-
-        for i in color.0.iter_mut() {
-            *i = (*i).saturating_add(40);
+    /// Run `f` on the pool of the formatter if it has one. `f` is told whether it may run
+    /// in parallel, which it may not if the formatter uses a single thread.
+    fn in_pool<R: Send>(&self, f: impl FnOnce(bool) -> R + Send) -> R {
+        match &self.thread_pool {
+            Some(pool) => pool.install(|| f(true)),
+            None => f(self.threads != 1),
         }
+    }
 
-        let shadow = RgbaImage::from_pixel(width, height, color);
+    fn highlight_lines(
+        &self,
+        band: &mut Rows<'_>,
+        columns: (u32, u32),
+        top: u32,
+        lines: u32,
+        background: Rgba<u8>,
+    ) {
+        let height = self.font.get_font_height() + self.line_pad;
+        let bottom = top + band.height();
+        let color = highlight_color(background);
 
-        for i in lines {
+        for &i in self
+            .highlight_lines
+            .iter()
+            .filter(|&&n| n >= 1 && n <= lines)
+        {
             let y = self.get_line_y(i - 1);
-            copy_alpha(&shadow, image.as_mut_rgba8().unwrap(), 0, y);
+            // only the rows of the line in this band
+            let (start, end) = (y.max(top), (y + height).min(bottom));
+            if start < end {
+                let width = columns.1 - columns.0;
+                fill_alpha(band, (columns.0, start - top), (width, end - start), color);
+            }
         }
     }
 
-    // TODO: use &T instead of &mut T ?
-    pub fn format(&mut self, v: &[Vec<(Style, &str)>], theme: &Theme) -> DynamicImage {
-        if self.line_number {
-            self.line_number_chars =
-                (((v.len() + self.line_offset as usize) as f32).log10() + 1.0).floor() as u32;
+    /// Fill the code area of the band with the background, except the pixels cut out by
+    /// the round corners
+    fn fill_background(
+        &self,
+        band: &mut Rows<'_>,
+        left: u32,
+        top: u32,
+        size: (u32, u32),
+        background: Rgba<u8>,
+    ) {
+        let (top_insets, bottom_insets) = if self.round_corner {
+            corner_insets(CORNER_RADIUS)
         } else {
-            self.line_number_chars = 0;
-            self.line_number_pad = 0;
+            (vec![], vec![])
+        };
+
+        let stride = band.width() as usize * 4;
+        let raw: &mut [u8] = band;
+        for (j, row) in raw.chunks_exact_mut(stride).enumerate() {
+            let y = top + j as u32;
+            let from_bottom = size.1 - 1 - y;
+            let (l, r) = if (y as usize) < top_insets.len() {
+                top_insets[y as usize]
+            } else if (from_bottom as usize) < bottom_insets.len() {
+                bottom_insets[bottom_insets.len() - 1 - from_bottom as usize]
+            } else {
+                (0, 0)
+            };
+
+            let (start, end) = ((left + l) as usize * 4, (left + size.0 - r) as usize * 4);
+            for pixel in row[start..end].chunks_exact_mut(4) {
+                pixel.copy_from_slice(&background.0);
+            }
+        }
+    }
+
+    /// Draw the band of the code image which starts at the row `top` of the code, to a band
+    /// of an image in which the code is `left` pixels from the left. `size` is the size of
+    /// the whole code image.
+    ///
+    /// The pixels of the code area are written over, except out of the round corners, so
+    /// the code can be drawn directly onto an opaque background. Its layers are drawn in
+    /// a single pass over each band: background, highlighted lines, glyphs and window
+    /// controls.
+    pub(crate) fn draw_code_band(
+        &self,
+        band: &mut Rows<'_>,
+        left: u32,
+        top: u32,
+        size: (u32, u32),
+        drawables: &Drawable,
+        background: Rgba<u8>,
+    ) {
+        let columns = (left, left + size.0);
+        self.fill_background(band, left, top, size, background);
+
+        self.highlight_lines(band, columns, top, drawables.max_lineno + 1, background);
+
+        self.draw_code(band, columns, top, drawables);
+
+        // draw_window_controls == true
+        if self.code_pad_top != 0 && top == 0 {
+            add_window_controls(band, left, 0, background);
         }
+    }
+
+    /// Draw the code image alone, transparent out of the round corners
+    fn draw_code_image(
+        &self,
+        size: (u32, u32),
+        drawables: &Drawable,
+        background: Rgba<u8>,
+        context: &mut RenderContext,
+    ) -> RgbaImage {
+        let mut image = context.image(size.0, size.1, TRANSPARENT);
+        let mut band = rows(&mut image, 0, size.1);
+        self.draw_code_band(&mut band, 0, 0, size, drawables, background);
+        image
+    }
+
+    /// The thread pool which draws the code, if the formatter uses several threads. The code
+    /// can be highlighted on it by `highlight_parallel`, so that both use the same threads.
+    pub fn thread_pool(&self) -> Option<Arc<ThreadPool>> {
+        self.thread_pool.clone()
+    }
+
+    /// The files which the fonts of the formatter were loaded from
+    pub fn font_files(&self) -> &[PathBuf] {
+        self.font.files()
+    }
+
+    pub fn format(&self, v: &[Vec<(Style, &str)>], theme: &Theme) -> DynamicImage {
+        self.format_lines(v, theme)
+    }
 
-        let drawables = self.create_drawables(v);
+    /// Format the lines, reusing the buffers of the context
+    pub fn format_with<I, L, S>(
+        &self,
+        lines: I,
+        theme: &Theme,
+        context: &mut RenderContext,
+    ) -> DynamicImage
+    where
+        I: IntoIterator<Item = L>,
+        L: AsRef<[(Style, S)]>,
+        S: AsRef<str>,
+    {
+        let (foreground, background) = theme_colors(theme);
 
+        let drawables = self.layout(lines, foreground, context);
+        let image = self.draw_image(&drawables, background, context);
+        context.recycle_drawables(drawables);
+        image
+    }
+
+    /// Format the lines given by an iterator.
+    ///
+    /// The lines are laid out as soon as they are received, so they can be highlighted on
+    /// another thread at the same time, without keeping the highlighted tokens of the
+    /// whole code.
+    pub fn format_lines<I, L, S>(&self, lines: I, theme: &Theme) -> DynamicImage
+    where
+        I: IntoIterator<Item = L>,
+        L: AsRef<[(Style, S)]>,
+        S: AsRef<str>,
+    {
+        self.format_with(lines, theme, &mut RenderContext::new())
+    }
+
+    /// Create the drawables, as the stage `layout` of the profile.
+    ///
+    /// When the lines are highlighted at the same time, it includes waiting for them.
+    fn layout<I, L, S>(
+        &self,
+        lines: I,
+        foreground: Rgba<u8>,
+        context: &mut RenderContext,
+    ) -> Drawable
+    where
+        I: IntoIterator<Item = L>,
+        L: AsRef<[(Style, S)]>,
+        S: AsRef<str>,
+    {
+        time(self.profiler.as_ref(), "layout", || {
+            self.create_drawables(lines, foreground, context)
+        })
+    }
+
+    /// Draw the whole image, with the shadow
+    pub(crate) fn draw_image(
+        &self,
+        drawables: &Drawable,
+        background: Rgba<u8>,
+        context: &mut RenderContext,
+    ) -> DynamicImage {
         let size = self.get_image_size(drawables.max_width, drawables.max_lineno);
+        let profiler = self.profiler.as_ref();
 
-        let foreground = theme.settings.foreground.unwrap();
-        let background = theme.settings.background.unwrap();
+        let adder = match &self.shadow_adder {
+            Some(adder) => adder,
+            None => {
+                return DynamicImage::ImageRgba8(time(profiler, "draw", || {
+                    self.draw_code_image(size, drawables, background, context)
+                }))
+            }
+        };
 
-        let foreground = foreground.to_rgba();
-        let background = background.to_rgba();
+        let mut shadow = time(profiler, "shadow", || {
+            let (width, height) = adder.size_for(size.0, size.1);
+            let mut shadow = match adder.solid_background() {
+                Some(color) => context.image(width, height, color),
+                None => adder.background_image(width, height),
+            };
+            self.in_pool(|parallel| adder.draw_shadow(&mut shadow, size.0, size.1, parallel));
+            shadow
+        });
 
-        let mut image = DynamicImage::ImageRgba8(RgbaImage::from_pixel(size.0, size.1, background));
+        time(profiler, "draw", || {
+            let (x, y) = adder.offset();
+            if background.0[3] == 255 {
+                // nothing shows through the code, draw it in place
+                let mut band = rows(&mut shadow, y, size.1);
+                self.draw_code_band(&mut band, x, 0, size, drawables, background);
+            } else {
+                let image = self.draw_code_image(size, drawables, background, context);
+                copy_alpha(&image, &mut shadow, x, y);
+                context.recycle_image(image);
+            }
+        });
+        DynamicImage::ImageRgba8(shadow)
+    }
+
+    /// Where the code image is placed in the final image
+    pub(crate) fn code_offset(&self) -> (u32, u32) {
+        self.shadow_adder
+            .as_ref()
+            .map_or((0, 0), |adder| adder.offset())
+    }
+
+    /// Format the lines and write the image as PNG, band by band.
+    ///
+    /// Only a band of the image is kept in memory at once, unless the background of the
+    /// shadow is an image, which has to be resized as a whole, or the palette is enabled,
+    /// which needs all the colors before the first row.
+    pub fn format_png<I, L, S, W>(&self, lines: I, theme: &Theme, out: W) -> io::Result<W>
+    where
+        I: IntoIterator<Item = L>,
+        L: AsRef<[(Style, S)]>,
+        S: AsRef<str>,
+        W: Write,
+    {
+        self.format_png_with(lines, theme, &mut RenderContext::new(), out)
+    }
+
+    /// Format the lines and write the image as PNG, reusing the buffers of the context
+    pub fn format_png_with<I, L, S, W>(
+        &self,
+        lines: I,
+        theme: &Theme,
+        context: &mut RenderContext,
+        out: W,
+    ) -> io::Result<W>
+    where
+        I: IntoIterator<Item = L>,
+        L: AsRef<[(Style, S)]>,
+        S: AsRef<str>,
+        W: Write,
+    {
+        let adder = self.shadow_adder.as_ref();
+        if self.png_options.palette
+            || adder.map_or(false, |adder| adder.solid_background().is_none())
+        {
+            let image = self.format_with(lines, theme, context);
+            let result = time(self.profiler.as_ref(), "encode", || {
+                encode_png(image.as_rgba8().unwrap(), out, &self.png_options)
+            });
+            context.recycle(image);
+            return result;
+        }
+
+        let (foreground, background) = theme_colors(theme);
+
+        let drawables = self.layout(lines, foreground, context);
+
+        let (code_width, code_height) =
+            self.get_image_size(drawables.max_width, drawables.max_lineno);
+
+        let adder = self.shadow_adder.as_ref();
+        let (width, height) = adder.map_or((code_width, code_height), |adder| {
+            adder.size_for(code_width, code_height)
+        });
+        let (x, y) = adder.map_or((0, 0), |adder| adder.offset());
+        let profile = adder.and_then(|adder| adder.shadow_profile(code_width, code_height));
+
+        let profiler = self.profiler.as_ref();
+        let mut encoder = PngEncoder::new(out, width, height, &self.png_options)?;
+        for (top, bottom) in split_bands(height, y, code_height) {
+            let has_code = top >= y && bottom <= y + code_height;
+            let band = time(profiler, "draw", || match adder {
+                Some(adder) => {
+                    let color = adder.solid_background().unwrap();
+                    let mut band = context.image(width, bottom - top, color);
+                    if let Some(profile) = &profile {
+                        self.in_pool(|parallel| {
+                            adder.draw_shadow_band(&mut band, top, profile, parallel)
+                        });
+                    }
+                    if has_code {
+                        let code_top = top - y;
+                        if background.0[3] == 255 {
+                            let mut code = rows(&mut band, 0, bottom - top);
+                            self.draw_code_band(
+                                &mut code,
+                                x,
+                                code_top,
+                                (code_width, code_height),
+                                &drawables,
+                                background,
+                            );
+                        } else {
+                            let mut code = context.image(code_width, bottom - top, TRANSPARENT);
+                            self.draw_code_band(
+                                &mut rows(&mut code, 0, bottom - top),
+                                0,
+                                code_top,
+                                (code_width, code_height),
+                                &drawables,
+                                background,
+                            );
+                            copy_alpha(&code, &mut band, x, 0);
+                            context.recycle_image(code);
+                        }
+                    }
+                    band
+                }
+                None => {
+                    let mut band = context.image(width, bottom - top, TRANSPARENT);
+                    self.draw_code_band(
+                        &mut rows(&mut band, 0, bottom - top),
+                        0,
+                        top,
+                        (code_width, code_height),
+                        &drawables,
+                        background,
+                    );
+                    band
+                }
+            });
+            time(profiler, "encode", || encoder.write_rows(&band))?;
+            context.recycle_image(band);
+        }
+        context.recycle_drawables(drawables);
+        time(profiler, "encode", || encoder.finish())
+    }
+
+    /// Format the lines as an SVG image.
+    ///
+    /// The layout is the same as the one of `format`, but the code is written as text in
+    /// the fonts of the formatter, so the image can be scaled freely. The viewer draws the
+    /// glyphs, from the fonts installed on its system. The shadow is a blur filter, and a
+    /// background image is embedded as PNG.
+    pub fn format_svg<I, L, S, W>(&self, lines: I, theme: &Theme, mut out: W) -> io::Result<W>
+    where
+        I: IntoIterator<Item = L>,
+        L: AsRef<[(Style, S)]>,
+        S: AsRef<str>,
+        W: Write,
+    {
+        let (foreground, background) = theme_colors(theme);
+        let lines = lines
+            .into_iter()
+            .map(|tokens| {
+                tokens
+                    .as_ref()
+                    .iter()
+                    .map(|(style, text)| (*style, text.as_ref().to_owned()))
+                    .collect::<Vec<_>>()
+            })
+            .collect::<Vec<_>>();
+
+        // only the sizes are used, the glyphs are drawn by the viewer
+        let drawables = self.layout(&lines, foreground, &mut RenderContext::new());
+        let size = self.get_image_size(drawables.max_width, drawables.max_lineno);
+        let (x, y) = self.code_offset();
+        let (width, height) = self
+            .shadow_adder
+            .as_ref()
+            .map_or(size, |adder| adder.size_for(size.0, size.1));
+
+        let profiler = self.profiler.as_ref();
+        let doc = time(profiler, "draw", || -> io::Result<String> {
+            let mut doc = String::new();
+            writeln!(
+                doc,
+                r#"<svg xmlns="http://www.w3.org/2000/svg" xmlns:xlink="http://www.w3.org/1999/xlink" width="{w}" height="{h}" viewBox="0 0 {w} {h}">"#,
+                w = width,
+                h = height
+            )
+            .unwrap();
+
+            if let Some(adder) = &self.shadow_adder {
+                self.write_svg_shadow(&mut doc, adder, (width, height), size)?;
+            }
+
+            let radius = if self.round_corner { CORNER_RADIUS } else { 0 };
+            let code_rect = format!(
+                r#"x="{}" y="{}" width="{}" height="{}" rx="{}""#,
+                x, y, size.0, size.1, radius
+            );
+            writeln!(
+                doc,
+                r#"<clipPath id="code"><rect {}/></clipPath>"#,
+                code_rect
+            )
+            .unwrap();
+            writeln!(doc, r#"<g clip-path="url(#code)">"#).unwrap();
+            writeln!(doc, r#"<rect {} {}/>"#, code_rect, svg::fill(background)).unwrap();
 
-        if !self.highlight_lines.is_empty() {
-            let highlight_lines = self
+            let line_height = self.get_line_height();
+            let lines_count = drawables.max_lineno + 1;
+            for &i in self
                 .highlight_lines
                 .iter()
-                .cloned()
-                .filter(|&n| n >= 1 && n <= drawables.max_lineno + 1);
-            self.highlight_lines(&mut image, highlight_lines);
-        }
-        if self.line_number {
-            self.draw_line_number(&mut image, drawables.max_lineno, foreground);
+                .filter(|&&n| n >= 1 && n <= lines_count)
+            {
+                writeln!(
+                    doc,
+                    r#"<rect x="{}" y="{}" width="{}" height="{}" {}/>"#,
+                    x,
+                    y + self.get_line_y(i - 1),
+                    size.0,
+                    line_height,
+                    svg::fill(highlight_color(background))
+                )
+                .unwrap();
+            }
+
+            // draw_window_controls == true
+            if self.code_pad_top != 0 {
+                doc += &svg::window_controls(x, y);
+            }
+
+            self.write_svg_text(&mut doc, &lines, &drawables, (x, y), foreground);
+            doc += "</g>\n</svg>\n";
+            Ok(doc)
+        })?;
+
+        time(profiler, "encode", || out.write_all(doc.as_bytes()))?;
+        Ok(out)
+    }
+
+    /// Write the background and the shadow of the SVG image
+    fn write_svg_shadow(
+        &self,
+        doc: &mut String,
+        adder: &ShadowAdder,
+        (width, height): (u32, u32),
+        size: (u32, u32),
+    ) -> io::Result<()> {
+        match adder.solid_background() {
+            Some(color) => {
+                writeln!(
+                    doc,
+                    r#"<rect width="100%" height="100%" {}/>"#,
+                    svg::fill(color)
+                )
+            }
+            None => {
+                let image = adder.background_image(width, height);
+                let png = encode_png(&image, vec![], &self.png_options)?;
+                writeln!(
+                    doc,
+                    r#"<image width="{}" height="{}" xlink:href="data:image/png;base64,{}"/>"#,
+                    width,
+                    height,
+                    svg::base64(&png)
+                )
+            }
         }
+        .unwrap();
 
-        for (x, y, color, style, text) in drawables.drawables {
-            let color = color.to_rgba();
-            self.font
-                .draw_text_mut(&mut image, color, x, y, style, &text);
+        let (color, blur_radius, (dx, dy)) = adder.shadow();
+        if blur_radius > 0.0 {
+            // the blur is clipped to the image, like the shadow of `format`
+            writeln!(
+                doc,
+                r#"<filter id="shadow" filterUnits="userSpaceOnUse" x="0" y="0" width="{}" height="{}"><feGaussianBlur stdDeviation="{}"/></filter>"#,
+                width, height, blur_radius
+            )
+            .unwrap();
+            let (x, y) = adder.offset();
+            writeln!(
+                doc,
+                r#"<rect x="{}" y="{}" width="{}" height="{}" {} filter="url(#shadow)"/>"#,
+                x as i32 + dx,
+                y as i32 + dy,
+                size.0,
+                size.1,
+                svg::fill(color)
+            )
+            .unwrap();
         }
+        Ok(())
+    }
 
-        // draw_window_controls == true
-        if self.code_pad_top != 0 {
-            add_window_controls(&mut image);
+    /// Write the code and the line numbers of the SVG image, as a text element for each line
+    fn write_svg_text(
+        &self,
+        doc: &mut String,
+        lines: &[Vec<(Style, String)>],
+        drawables: &Drawable,
+        (x, y): (u32, u32),
+        foreground: Rgba<u8>,
+    ) {
+        let families = self
+            .font
+            .family_names()
+            .iter()
+            .map(|name| format!("'{}'", svg::escape(name)))
+            .collect::<Vec<_>>();
+        writeln!(
+            doc,
+            r#"<g font-family="{}, monospace" font-size="{}" xml:space="preserve">"#,
+            families.join(", "),
+            self.font.font_size()
+        )
+        .unwrap();
+
+        let tab = " ".repeat(self.tab_width as usize);
+        let left_pad = self.get_left_pad(drawables.line_number_chars);
+        let baseline = y as i32 + self.font.get_baseline();
+        let mut glyphs = vec![];
+
+        for (i, tokens) in lines.iter().enumerate() {
+            let line_y = baseline + self.get_line_y(i as u32) as i32;
+            let mut spans = String::new();
+            let mut width = 0;
+
+            for (style, text) in tokens {
+                let text = text.trim_end_matches('\n');
+                if text.is_empty() {
+                    continue;
+                }
+
+                let font_style = style.font_style.into();
+                let attributes = match font_style {
+                    FontStyle::REGULAR => "",
+                    FontStyle::ITALIC => r#" font-style="italic""#,
+                    FontStyle::BOLD => r#" font-weight="bold""#,
+                    FontStyle::BOLDITALIC => r#" font-weight="bold" font-style="italic""#,
+                };
+                write!(
+                    spans,
+                    r#"<tspan x="{}" {}{}>{}</tspan>"#,
+                    x + left_pad + width,
+                    svg::fill(style.foreground.to_rgba()),
+                    attributes,
+                    svg::escape(&text.replace('\t', &tab))
+                )
+                .unwrap();
+
+                glyphs.clear();
+                width += self.layout_token(text, font_style, 0, 0, &tab, &mut glyphs);
+            }
+            if !spans.is_empty() {
+                writeln!(doc, r#"<text y="{}">{}</text>"#, line_y, spans).unwrap();
+            }
         }
 
-        if self.round_corner {
-            round_corner(&mut image, 12);
+        if self.line_number {
+            let color = svg::fill(line_number_color(foreground));
+            // there is always a line number, even if there is no code
+            for line in 0..lines.len().max(1) as u32 {
+                writeln!(
+                    doc,
+                    r#"<text x="{}" y="{}" {}>{:>width$}</text>"#,
+                    x + self.code_pad,
+                    baseline + self.get_line_y(line) as i32,
+                    color,
+                    line + self.line_offset,
+                    width = drawables.line_number_chars as usize
+                )
+                .unwrap();
+            }
         }
+        doc.push_str("</g>\n");
+    }
+}
 
-        if let Some(adder) = &self.shadow_adder {
-            adder.apply_to(&image)
-        } else {
-            image
+/// The color of the line numbers
+fn line_number_color(foreground: Rgba<u8>) -> Rgba<u8> {
+    let mut color = foreground;
+    for i in color.0.iter_mut() {
+        *i = (*i).saturating_sub(20);
+    }
+    color
+}
+
+/// The color of the highlighted lines
+fn highlight_color(background: Rgba<u8>) -> Rgba<u8> {
+    let mut color = background;
+    for i in color.0.iter_mut() {
+        *i = (*i).saturating_add(40);
+    }
+    color
+}
+
+/// The foreground and background of the theme
+pub(crate) fn theme_colors(theme: &Theme) -> (Rgba<u8>, Rgba<u8>) {
+    let foreground = theme.settings.foreground.unwrap();
+    let background = theme.settings.background.unwrap();
+
+    (foreground.to_rgba(), background.to_rgba())
+}
+
+/// Split the rows of the final image into bands of about `BAND_ROWS` rows. A band contains
+/// either all the rows or none of the rows of the code image which are in it, and the
+/// bands of the code image are not shorter than `BAND_ROWS`, so that the window controls
+/// and the round corners fit in them.
+fn split_bands(height: u32, code_top: u32, code_height: u32) -> Vec<(u32, u32)> {
+    let code_bottom = code_top + code_height;
+    let mut bands = vec![];
+
+    for (start, end) in &[(0, code_top), (code_bottom, height)] {
+        for top in (*start..*end).step_by(BAND_ROWS as usize) {
+            bands.push((top, (top + BAND_ROWS).min(*end)));
         }
     }
+
+    let n = (code_height / BAND_ROWS).max(1);
+    for i in 0..n {
+        let top = code_top + code_height * i / n;
+        let bottom = code_top + code_height * (i + 1) / n;
+        bands.push((top, bottom));
+    }
+
+    bands.sort_unstable();
+    bands
 }
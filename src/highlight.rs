@@ -0,0 +1,239 @@
+//! Highlight large files faster than line by line
+//!
+//! [`highlight_range`] only highlights the lines which are shown.
+//!
+//! [`highlight_parallel`] highlights the code on several threads. The code is split into chunks at lines which most likely start at the top level of the
+//! syntax: lines which aren't indented, after an empty line. Finding them doesn't need to
+//! parse the code. The first chunk is highlighted from the initial state, the others from
+//! the state of the parser at the top level, all of them at the same time, on the current
+//! rayon pool: the one the caller runs it in with `ThreadPool::install`, or the global pool.
+//!
+//! Then the state at the end of each chunk is checked against the state the next chunk
+//! started from, and the next chunk is highlighted again from the right state if they
+//! differ (eg. a chunk starting in a multiline string). So the result is always the same as
+//! highlighting the lines one by one.
+use rayon::prelude::*;
+use std::ops::Range;
+use syntect::highlighting::{HighlightIterator, HighlightState, Highlighter, Style, Theme};
+use syntect::parsing::{ParseState, ScopeStack, SyntaxReference, SyntaxSet};
+use syntect::util::LinesWithEndings;
+
+/// Min number of lines in a chunk, smaller ones are not worth a thread
+const MIN_CHUNK_LINES: usize = 256;
+
+/// The tokens of a line, with their style
+pub type HighlightedLine<'a> = Vec<(Style, &'a str)>;
+
+/// The state of the highlighting between two lines
+#[derive(Clone, PartialEq)]
+struct State {
+    parse: ParseState,
+    highlight: HighlightState,
+}
+
+impl State {
+    fn new(syntax: &SyntaxReference, highlighter: &Highlighter) -> Self {
+        Self {
+            parse: ParseState::new(syntax),
+            highlight: HighlightState::new(highlighter, ScopeStack::new()),
+        }
+    }
+
+    fn highlight<'a>(
+        &mut self,
+        line: &'a str,
+        ps: &SyntaxSet,
+        highlighter: &Highlighter,
+    ) -> HighlightedLine<'a> {
+        let ops = self.parse.parse_line(line, ps);
+        HighlightIterator::new(&mut self.highlight, &ops, line, highlighter).collect()
+    }
+}
+
+/// Highlight the lines from the state, and return the state after the last one
+fn highlight_chunk<'a>(
+    lines: &[&'a str],
+    mut state: State,
+    ps: &SyntaxSet,
+    highlighter: &Highlighter,
+) -> (Vec<HighlightedLine<'a>>, State) {
+    let lines = lines
+        .iter()
+        .map(|line| state.highlight(line, ps, highlighter))
+        .collect();
+    (lines, state)
+}
+
+/// Whether the line probably starts at the top level of the syntax
+fn is_boundary(previous: &str, line: &str) -> bool {
+    previous.trim().is_empty() && line.starts_with(|c: char| !c.is_whitespace())
+}
+
+/// The first line of each chunk, at most `chunks` of them
+fn split_chunks(lines: &[&str], chunks: usize) -> Vec<usize> {
+    let size = (lines.len() / chunks.max(1)).max(MIN_CHUNK_LINES);
+    let mut starts = vec![0];
+    for i in 1..lines.len() {
+        if i - starts[starts.len() - 1] >= size && is_boundary(lines[i - 1], lines[i]) {
+            starts.push(i);
+        }
+    }
+    starts
+}
+
+/// Highlight the code like `HighlightLines`, with the chunks between safe boundaries on
+/// the threads of rayon. The code is highlighted sequentially if there is no such boundary.
+pub fn highlight_parallel<'a>(
+    code: &'a str,
+    syntax: &SyntaxReference,
+    theme: &Theme,
+    ps: &SyntaxSet,
+) -> Vec<HighlightedLine<'a>> {
+    let highlighter = Highlighter::new(theme);
+    let lines = LinesWithEndings::from(code).collect::<Vec<_>>();
+    let initial = State::new(syntax, &highlighter);
+
+    let starts = split_chunks(&lines, rayon::current_num_threads() * 4);
+    if starts.len() == 1 {
+        return highlight_chunk(&lines, initial, ps, &highlighter).0;
+    }
+
+    // the state after an empty line at the top level
+    let top_level = {
+        let mut state = initial.clone();
+        state.highlight("\n", ps, &highlighter);
+        state
+    };
+
+    let chunk_lines = |i: usize| {
+        let end = starts.get(i + 1).copied().unwrap_or_else(|| lines.len());
+        &lines[starts[i]..end]
+    };
+    let chunks = (0..starts.len())
+        .into_par_iter()
+        .map(|i| {
+            let state = if i == 0 { &initial } else { &top_level };
+            highlight_chunk(chunk_lines(i), state.clone(), ps, &highlighter)
+        })
+        .collect::<Vec<_>>();
+
+    // merge the chunks in order, fixing those which didn't start from the right state
+    let mut result = Vec::with_capacity(lines.len());
+    let mut previous: Option<State> = None;
+    for (i, (chunk, end)) in chunks.into_iter().enumerate() {
+        let (chunk, end) = match previous {
+            Some(state) if state != top_level => {
+                highlight_chunk(chunk_lines(i), state, ps, &highlighter)
+            }
+            _ => (chunk, end),
+        };
+        result.extend(chunk);
+        previous = Some(end);
+    }
+    result
+}
+
+/// Highlight the lines in the range (counted from 0) like `HighlightLines`.
+///
+/// The lines before the range are only parsed to get the scopes at its start, and the lines
+/// after it aren't read.
+pub fn highlight_range<'a>(
+    code: &'a str,
+    range: Range<usize>,
+    syntax: &SyntaxReference,
+    theme: &Theme,
+    ps: &SyntaxSet,
+) -> Vec<HighlightedLine<'a>> {
+    let highlighter = Highlighter::new(theme);
+    let mut lines = LinesWithEndings::from(code);
+
+    // the styles of the skipped lines don't matter, only the scopes left open by them
+    let mut parse = ParseState::new(syntax);
+    let mut stack = ScopeStack::new();
+    for line in lines.by_ref().take(range.start) {
+        for (_, op) in parse.parse_line(line, ps) {
+            stack.apply(&op);
+        }
+    }
+
+    let mut state = State {
+        parse,
+        highlight: HighlightState::new(&highlighter, stack),
+    };
+    lines
+        .take(range.end.saturating_sub(range.start))
+        .map(|line| state.highlight(line, ps, &highlighter))
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{highlight_parallel, highlight_range, MIN_CHUNK_LINES};
+    use crate::utils::init_syntect;
+    use syntect::easy::HighlightLines;
+    use syntect::util::LinesWithEndings;
+
+    /// Rust code with a long multiline comment or string in the middle. It's full of lines
+    /// which look like the start of a chunk, so some chunks start in it.
+    fn code(open: &str, close: &str) -> String {
+        let functions = |name: &str| {
+            (0..200)
+                .map(|i| format!("fn {}{}() {{\n    let x = \"{}\";\n}}\n\n", name, i, i))
+                .collect::<String>()
+        };
+        let middle = (0..600)
+            .map(|i| format!("\nfn line{}() {{}}\n", i))
+            .collect::<String>();
+        format!(
+            "{}{}{}{}\n{}",
+            functions("before"),
+            open,
+            middle,
+            close,
+            functions("after")
+        )
+    }
+
+    #[test]
+    fn parallel_is_sequential() {
+        let (ps, ts) = init_syntect();
+        let syntax = ps.find_syntax_by_token("rs").unwrap();
+        let theme = &ts.themes["Dracula"];
+
+        for (open, close) in &[("/*", "*/"), ("const S: &str = r#\"", "\"#;")] {
+            let code = code(open, close);
+            assert!(LinesWithEndings::from(&code).count() > MIN_CHUNK_LINES * 4);
+
+            let mut h = HighlightLines::new(syntax, theme);
+            let expected = LinesWithEndings::from(&code)
+                .map(|line| h.highlight(line, &ps))
+                .collect::<Vec<_>>();
+            let lines = highlight_parallel(&code, syntax, theme, &ps);
+
+            assert_eq!(lines.len(), expected.len());
+            for (i, (line, expected)) in lines.iter().zip(&expected).enumerate() {
+                assert_eq!(line, expected, "line {} of {}", i, open);
+            }
+        }
+    }
+
+    #[test]
+    fn range_is_slice() {
+        let (ps, ts) = init_syntect();
+        let syntax = ps.find_syntax_by_token("rs").unwrap();
+        let theme = &ts.themes["Dracula"];
+
+        let code = code("/*", "*/");
+        let mut h = HighlightLines::new(syntax, theme);
+        let full = LinesWithEndings::from(&code)
+            .map(|line| h.highlight(line, &ps))
+            .collect::<Vec<_>>();
+
+        // from the start, in the comment, across its ends, past the end of the code
+        let len = full.len();
+        for range in &[0..10, 900..950, 790..820, 1990..2030, len - 20..len + 20] {
+            let lines = highlight_range(&code, range.clone(), syntax, theme, &ps);
+            assert_eq!(lines, &full[range.start..range.end.min(len)], "{:?}", range);
+        }
+    }
+}
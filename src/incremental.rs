@@ -0,0 +1,300 @@
+//! Re-render a snippet which is edited, reusing the previous render
+//!
+//! The highlighting states after each line are kept, so a new version of the code is
+//! highlighted from the first changed line, until the states are the same as before the
+//! edit. If the size of the image doesn't change, only the rows of the changed lines are
+//! drawn again, the rest of the previous image is kept.
+use crate::formatter::{theme_colors, ImageFormatter, RenderContext};
+use crate::utils::rows;
+use image::DynamicImage;
+use syntect::highlighting::{HighlightIterator, HighlightState, Highlighter, Style, Theme};
+use syntect::parsing::{ParseState, ScopeStack, SyntaxReference, SyntaxSet};
+use syntect::util::LinesWithEndings;
+
+/// A highlighted line and the highlighting states after it
+struct HighlightedLine {
+    text: String,
+    tokens: Vec<(Style, String)>,
+    parse_state: ParseState,
+    highlight_state: HighlightState,
+}
+
+/// The last image and what it was rendered from
+struct Rendered {
+    image: DynamicImage,
+    /// size of the code image
+    size: (u32, u32),
+    /// number of lines
+    lines: usize,
+}
+
+pub struct IncrementalFormatter {
+    formatter: ImageFormatter,
+    context: RenderContext,
+    lines: Vec<HighlightedLine>,
+    /// name of the syntax and the theme of the cached lines
+    syntax: String,
+    theme: Option<Theme>,
+    rendered: Option<Rendered>,
+}
+
+impl IncrementalFormatter {
+    pub fn new(formatter: ImageFormatter) -> Self {
+        Self {
+            formatter,
+            context: RenderContext::new(),
+            lines: vec![],
+            syntax: String::new(),
+            theme: None,
+            rendered: None,
+        }
+    }
+
+    /// Forget the previous render.
+    ///
+    /// The syntax is compared by name, so it should be called when a syntax is modified
+    /// without being renamed.
+    pub fn reset(&mut self) {
+        self.lines.clear();
+        self.rendered = None;
+    }
+
+    /// Format the code, drawing only the lines changed since the last call
+    pub fn format(
+        &mut self,
+        code: &str,
+        syntax: &SyntaxReference,
+        ps: &SyntaxSet,
+        theme: &Theme,
+    ) -> &DynamicImage {
+        // themes are compared as a whole, they often have no name
+        if self.syntax != syntax.name || self.theme.as_ref() != Some(theme) {
+            self.reset();
+            self.syntax = syntax.name.clone();
+            self.theme = Some(theme.clone());
+        }
+
+        let changed = self.highlight(code, syntax, ps, theme);
+
+        let (foreground, background) = theme_colors(theme);
+        let drawables = self.formatter.create_drawables(
+            self.lines.iter().map(|line| &line.tokens),
+            foreground,
+            &mut self.context,
+        );
+        let size = self
+            .formatter
+            .get_image_size(drawables.max_width, drawables.max_lineno);
+
+        // the previous image can be reused if the geometry didn't change, and if it's
+        // opaque, otherwise the old pixels would show through the new ones
+        let reusable = match &self.rendered {
+            Some(rendered) => {
+                rendered.size == size
+                    && rendered.lines == self.lines.len()
+                    && background.0[3] == 255
+            }
+            None => false,
+        };
+
+        if !reusable {
+            if let Some(rendered) = self.rendered.take() {
+                self.context.recycle(rendered.image);
+            }
+            self.rendered = Some(Rendered {
+                image: self
+                    .formatter
+                    .draw_image(&drawables, background, &mut self.context),
+                size,
+                lines: self.lines.len(),
+            });
+        } else if let Some((first, last)) = changed {
+            // glyphs may go beyond their line, so draw the lines around too
+            let top = self.formatter.get_line_y(first.saturating_sub(1) as u32);
+            let bottom = self
+                .formatter
+                .get_line_y((last + 2).min(self.lines.len()) as u32);
+
+            // the background is opaque, so the lines are drawn in place
+            let (x, y) = self.formatter.code_offset();
+            let image = self
+                .rendered
+                .as_mut()
+                .unwrap()
+                .image
+                .as_mut_rgba8()
+                .unwrap();
+            self.formatter.draw_code_band(
+                &mut rows(image, y + top, bottom - top),
+                x,
+                top,
+                size,
+                &drawables,
+                background,
+            );
+        }
+        self.context.recycle_drawables(drawables);
+
+        &self.rendered.as_ref().unwrap().image
+    }
+
+    /// Highlight the changed lines, return the range of lines which are changed
+    fn highlight(
+        &mut self,
+        code: &str,
+        syntax: &SyntaxReference,
+        ps: &SyntaxSet,
+        theme: &Theme,
+    ) -> Option<(usize, usize)> {
+        let text = LinesWithEndings::from(code).collect::<Vec<_>>();
+        let mut old = std::mem::take(&mut self.lines);
+        let (m, n) = (old.len(), text.len());
+
+        // the unchanged lines at the beginning and at the end
+        let prefix = old
+            .iter()
+            .zip(&text)
+            .take_while(|(line, text)| line.text == **text)
+            .count();
+        let suffix = old[prefix..]
+            .iter()
+            .rev()
+            .zip(text[prefix..].iter().rev())
+            .take_while(|(line, text)| line.text == **text)
+            .count();
+
+        let highlighter = Highlighter::new(theme);
+        let initial = (
+            ParseState::new(syntax),
+            HighlightState::new(&highlighter, ScopeStack::new()),
+        );
+        let (mut parse_state, mut highlight_state) = match prefix {
+            0 => initial.clone(),
+            n => (
+                old[n - 1].parse_state.clone(),
+                old[n - 1].highlight_state.clone(),
+            ),
+        };
+
+        let mut lines = vec![];
+        for (i, line) in text.iter().enumerate().skip(prefix) {
+            // once the states before a line of the suffix are the same as before the edit,
+            // the rest of the code is highlighted the same as before
+            if i >= n - suffix {
+                let j = i + m - n;
+                let converged = match j {
+                    0 => initial.0 == parse_state && initial.1 == highlight_state,
+                    _ => {
+                        old[j - 1].parse_state == parse_state
+                            && old[j - 1].highlight_state == highlight_state
+                    }
+                };
+                if converged {
+                    let rest = old.split_off(j);
+                    old.truncate(prefix);
+                    old.extend(lines);
+                    old.extend(rest);
+                    self.lines = old;
+                    return changed_range(prefix, i);
+                }
+            }
+
+            let ops = parse_state.parse_line(line, ps);
+            let tokens = HighlightIterator::new(&mut highlight_state, &ops, line, &highlighter)
+                .map(|(style, token)| (style, token.to_owned()))
+                .collect();
+            lines.push(HighlightedLine {
+                text: line.to_string(),
+                tokens,
+                parse_state: parse_state.clone(),
+                highlight_state: highlight_state.clone(),
+            });
+        }
+
+        old.truncate(prefix);
+        old.extend(lines);
+        self.lines = old;
+        changed_range(prefix, n)
+    }
+}
+
+fn changed_range(first: usize, end: usize) -> Option<(usize, usize)> {
+    if first < end {
+        Some((first, end - 1))
+    } else {
+        None
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::IncrementalFormatter;
+    use crate::formatter::{ImageFormatter, ImageFormatterBuilder};
+    use crate::utils::{init_syntect, ShadowAdder};
+    use image::GenericImageView;
+    use syntect::easy::HighlightLines;
+    use syntect::util::LinesWithEndings;
+
+    fn formatter() -> ImageFormatter {
+        ImageFormatterBuilder::<String>::new()
+            .shadow_adder(ShadowAdder::new())
+            .build()
+            .unwrap()
+    }
+
+    #[test]
+    fn same_as_format() {
+        let (ps, ts) = init_syntect();
+        let syntax = ps.find_syntax_by_token("rs").unwrap();
+        let theme = &ts.themes["Dracula"];
+        let fresh = formatter();
+        let mut incremental = IncrementalFormatter::new(formatter());
+
+        let versions = [
+            "fn main() {\n    let x = 1;\n    let y = 2;\n    println!(\"{}\", x + y);\n}\n",
+            // a line is edited, the image is drawn again in place
+            "fn main() {\n    let x = 3;\n    let y = 2;\n    println!(\"{}\", x + y);\n}\n",
+            // a line is inserted
+            "fn main() {\n    let x = 3;\n    let z = 4;\n    let y = 2;\n    println!(\"{}\", x + y);\n}\n",
+            // the highlighting of the following lines changes
+            "fn main() {\n    /* x = 3;\n    let z = 4;\n    let y = 2;\n    println!(\"{}\", x + y);\n}\n",
+            // and changes back
+            "fn main() {\n    let x = 3;\n    let z = 4;\n    let y = 2;\n    println!(\"{}\", x + y);\n}\n",
+        ];
+        for (i, code) in versions.iter().enumerate() {
+            let mut h = HighlightLines::new(syntax, theme);
+            let lines = LinesWithEndings::from(code)
+                .map(|line| h.highlight(line, &ps))
+                .collect::<Vec<_>>();
+            let expected = fresh.format(&lines, theme);
+
+            let image = incremental.format(code, syntax, &ps, theme);
+            assert_eq!(image.dimensions(), expected.dimensions(), "version {}", i);
+            assert!(image.as_bytes() == expected.as_bytes(), "version {}", i);
+        }
+    }
+
+    #[test]
+    fn theme_change() {
+        let (ps, ts) = init_syntect();
+        let syntax = ps.find_syntax_by_token("rs").unwrap();
+        let fresh = formatter();
+        let mut incremental = IncrementalFormatter::new(formatter());
+        let code = "fn main() {}\n";
+
+        // a theme without a name is still a different theme
+        let mut themes = ts.themes.values().take(2).cloned().collect::<Vec<_>>();
+        for theme in &mut themes {
+            theme.name = None;
+        }
+        for theme in &themes {
+            let mut h = HighlightLines::new(syntax, theme);
+            let lines = LinesWithEndings::from(code)
+                .map(|line| h.highlight(line, &ps))
+                .collect::<Vec<_>>();
+            let expected = fresh.format(&lines, theme);
+            let image = incremental.format(code, syntax, &ps, theme);
+            assert!(image.as_bytes() == expected.as_bytes());
+        }
+    }
+}
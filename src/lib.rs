@@ -22,7 +22,7 @@
 //!     .map(|line| h.highlight(line, &ps))
 //!     .collect::<Vec<_>>();
 //!
-//! let mut formatter = ImageFormatterBuilder::new()
+//! let formatter = ImageFormatterBuilder::new()
 //!     .font(vec![("Hack", 26.0)])
 //!     .shadow_adder(ShadowAdder::default())
 //!     .build()
@@ -36,7 +36,15 @@ extern crate log;
 
 pub mod blur;
 pub mod directories;
+pub mod encoder;
 pub mod error;
 pub mod font;
+mod font_index;
 pub mod formatter;
+pub mod highlight;
+pub mod incremental;
+pub mod profile;
+pub mod render_cache;
+pub mod render_pool;
+mod svg;
 pub mod utils;
@@ -0,0 +1,120 @@
+//! Timing of the stages of a render
+//!
+//! A [`Profiler`] given to the formatter is called with a [`Span`] at the end of each stage.
+//! The bytes allocated in a stage are only counted if [`CountingAllocator`] is the global
+//! allocator and is enabled. They are counted per thread, so stages running at the same
+//! time on different threads don't count each other's allocations.
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::Cell;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+/// A stage of a render
+#[derive(Clone, Debug)]
+pub struct Span {
+    pub name: &'static str,
+    pub start: Instant,
+    pub duration: Duration,
+    /// bytes allocated during the stage by the thread which ran it, the allocations of the
+    /// threads it waited for are not counted
+    pub allocated: u64,
+    /// number of the thread which ran the stage, in the order in which threads are first seen
+    pub thread: usize,
+}
+
+/// Called with every span when it ends, maybe from several threads at once
+pub type Profiler = Arc<dyn Fn(&Span) + Send + Sync>;
+
+/// Run `f` as the stage `name`, and report it to the profiler if there is one
+pub fn time<R, F>(profiler: Option<&Profiler>, name: &'static str, f: F) -> R
+where
+    F: FnOnce() -> R,
+{
+    let profiler = match profiler {
+        Some(profiler) => profiler,
+        None => return f(),
+    };
+
+    let before = allocated();
+    let start = Instant::now();
+    let result = f();
+    profiler(&Span {
+        name,
+        start,
+        duration: start.elapsed(),
+        allocated: allocated() - before,
+        thread: thread_number(),
+    });
+    result
+}
+
+fn thread_number() -> usize {
+    static NEXT: AtomicUsize = AtomicUsize::new(0);
+    thread_local! {
+        static NUMBER: Cell<Option<usize>> = Cell::new(None);
+    }
+
+    NUMBER.with(|number| {
+        number.get().unwrap_or_else(|| {
+            let next = NEXT.fetch_add(1, Ordering::Relaxed);
+            number.set(Some(next));
+            next
+        })
+    })
+}
+
+static COUNTING: AtomicBool = AtomicBool::new(false);
+
+thread_local! {
+    /// bytes allocated by the thread, `Cell<u64>` is initialized without allocating
+    static ALLOCATED: Cell<u64> = Cell::new(0);
+}
+
+/// Number of bytes allocated by the current thread since the counting was enabled
+pub fn allocated() -> u64 {
+    ALLOCATED.try_with(Cell::get).unwrap_or(0)
+}
+
+/// The system allocator, counting the allocated bytes once it is enabled
+///
+/// ```ignore
+/// #[global_allocator]
+/// static ALLOCATOR: CountingAllocator = CountingAllocator;
+/// ```
+pub struct CountingAllocator;
+
+impl CountingAllocator {
+    pub fn enable() {
+        COUNTING.store(true, Ordering::Relaxed);
+    }
+
+    #[inline]
+    fn count(size: usize) {
+        if COUNTING.load(Ordering::Relaxed) {
+            // the thread local is already destroyed when a thread frees its last buffers
+            let _ = ALLOCATED.try_with(|allocated| allocated.set(allocated.get() + size as u64));
+        }
+    }
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        Self::count(layout.size());
+        System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        Self::count(layout.size());
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        Self::count(new_size.saturating_sub(layout.size()));
+        System.realloc(ptr, layout, new_size)
+    }
+}
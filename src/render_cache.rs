@@ -0,0 +1,300 @@
+//! An on-disk cache of rendered images
+//!
+//! An image is saved under a hash of everything it depends on (code, syntax, theme and
+//! options), so the same render can be returned without highlighting or drawing anything.
+//! The least recently used images are removed when the cache is bigger than its max size.
+//! Each image is followed by its CRC-32, a damaged image is removed instead of returned.
+use crate::directories::PROJECT_DIRS;
+use std::collections::hash_map::DefaultHasher;
+use std::fs::{self, File, OpenOptions};
+use std::hash::{Hash, Hasher};
+use std::io::{self, Write};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::{Duration, SystemTime};
+
+/// An image which was used more recently than that is not marked as used again
+const TOUCH_INTERVAL: Duration = Duration::from_secs(60);
+
+/// Number of the next temporary file of this process
+static NEXT_TEMP: AtomicUsize = AtomicUsize::new(0);
+
+/// Identify a render by everything it depends on
+///
+/// It is computed by the hasher of `std`, which may change with the version of Rust.
+/// That only causes misses.
+pub struct RenderKey {
+    hashers: [DefaultHasher; 2],
+}
+
+impl Default for RenderKey {
+    fn default() -> Self {
+        // two different hashes, so that collisions are practically impossible
+        let mut second = DefaultHasher::new();
+        0x5111_c0de_u32.hash(&mut second);
+        Self {
+            hashers: [DefaultHasher::new(), second],
+        }
+    }
+}
+
+impl RenderKey {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Add something which the render depends on
+    pub fn add<H: Hash + ?Sized>(mut self, value: &H) -> Self {
+        for hasher in &mut self.hashers {
+            value.hash(hasher);
+        }
+        self
+    }
+
+    fn file_name(&self) -> String {
+        format!(
+            "{:016x}{:016x}",
+            self.hashers[0].finish(),
+            self.hashers[1].finish()
+        )
+    }
+}
+
+pub struct RenderCache {
+    dir: PathBuf,
+    /// max total size of the images, in bytes
+    max_size: u64,
+}
+
+impl RenderCache {
+    pub fn new<P: Into<PathBuf>>(dir: P, max_size: u64) -> Self {
+        Self {
+            dir: dir.into(),
+            max_size,
+        }
+    }
+
+    /// The default directory of the cache, in the cache directory of silicon
+    pub fn default_dir() -> PathBuf {
+        PROJECT_DIRS.cache_dir().join("silicon-renders")
+    }
+
+    /// Get the encoded image saved for the key
+    pub fn get(&self, key: &RenderKey) -> Option<Vec<u8>> {
+        let path = self.dir.join(key.file_name());
+        let mut data = fs::read(&path).ok()?;
+
+        let checksum = data.len().checked_sub(4).map(|len| data.split_off(len));
+        if checksum.as_deref() != Some(&crc32fast::hash(&data).to_be_bytes()[..]) {
+            debug!("Removing the damaged image {}", path.display());
+            let _ = fs::remove_file(&path);
+            return None;
+        }
+
+        // the modification time is used as the time of last use
+        let used = fs::metadata(&path)
+            .and_then(|metadata| metadata.modified())
+            .ok()
+            .and_then(|time| time.elapsed().ok());
+        if used.map_or(true, |used| used > TOUCH_INTERVAL) {
+            let touch = OpenOptions::new()
+                .write(true)
+                .open(&path)
+                .and_then(|file| file.set_modified(SystemTime::now()));
+            if let Err(e) = touch {
+                debug!("Failed to update {}: {}", path.display(), e);
+            }
+        }
+        Some(data)
+    }
+
+    /// Save the encoded image for the key, and remove the least recently used images if
+    /// the cache is too big
+    pub fn put(&self, key: &RenderKey, data: &[u8]) -> io::Result<()> {
+        fs::create_dir_all(&self.dir)?;
+        self.write(&self.dir.join(key.file_name()), data)?;
+        self.evict()
+    }
+
+    fn write(&self, path: &Path, data: &[u8]) -> io::Result<()> {
+        // write to a temporary file first so that other processes never read a partial image,
+        // the name is unique to the thread that writes it
+        let temp = path.with_extension(format!(
+            "{}.{}.tmp",
+            std::process::id(),
+            NEXT_TEMP.fetch_add(1, Ordering::Relaxed)
+        ));
+        File::create(&temp)
+            .and_then(|mut file| {
+                file.write_all(data)?;
+                file.write_all(&crc32fast::hash(data).to_be_bytes())
+            })
+            .and_then(|_| fs::rename(&temp, path))
+            .map_err(|e| {
+                let _ = fs::remove_file(&temp);
+                e
+            })
+    }
+
+    fn evict(&self) -> io::Result<()> {
+        let mut entries = vec![];
+        let mut size = 0;
+        for entry in fs::read_dir(&self.dir)?.filter_map(Result::ok) {
+            let metadata = match entry.metadata() {
+                Ok(metadata) => metadata,
+                Err(_) => continue,
+            };
+            let modified = metadata.modified().unwrap_or(SystemTime::UNIX_EPOCH);
+            let path = entry.path();
+            match path.extension() {
+                None => entries.push((modified, metadata.len(), path)),
+                // left by a process which was killed while writing
+                Some(ext) if ext == "tmp" && is_stale(modified) => {
+                    let _ = fs::remove_file(&path);
+                    continue;
+                }
+                Some(_) => {}
+            }
+            size += metadata.len();
+        }
+
+        if size <= self.max_size {
+            return Ok(());
+        }
+
+        // the least recently used first
+        entries.sort_unstable();
+        for (_, len, path) in entries {
+            if size <= self.max_size {
+                break;
+            }
+            if fs::remove_file(&path).is_ok() {
+                size -= len;
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Whether a temporary file is too old to still be written
+fn is_stale(modified: SystemTime) -> bool {
+    modified
+        .elapsed()
+        .map_or(false, |elapsed| elapsed > TOUCH_INTERVAL)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{RenderCache, RenderKey};
+    use std::fs::{self, OpenOptions};
+    use std::path::{Path, PathBuf};
+    use std::time::{Duration, SystemTime};
+
+    /// An empty directory for the test
+    fn cache_dir(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!(
+            "silicon-render-cache-{}-{}",
+            name,
+            std::process::id()
+        ));
+        let _ = fs::remove_dir_all(&dir);
+        dir
+    }
+
+    fn key(name: &str) -> RenderKey {
+        RenderKey::new().add(name)
+    }
+
+    /// Pretend that the image of the key was last used `age` ago
+    fn set_age(dir: &Path, key: &RenderKey, age: Duration) {
+        let file = OpenOptions::new()
+            .write(true)
+            .open(dir.join(key.file_name()))
+            .unwrap();
+        file.set_modified(SystemTime::now() - age).unwrap();
+    }
+
+    #[test]
+    fn round_trip() {
+        let dir = cache_dir("round-trip");
+        let cache = RenderCache::new(&dir, 1 << 20);
+
+        assert_eq!(cache.get(&key("a")), None);
+        cache.put(&key("a"), b"image a").unwrap();
+        cache.put(&key("b"), b"").unwrap();
+        assert_eq!(cache.get(&key("a")).as_deref(), Some(&b"image a"[..]));
+        assert_eq!(cache.get(&key("b")).as_deref(), Some(&b""[..]));
+        assert_eq!(cache.get(&key("c")), None);
+
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn evict_least_recently_used() {
+        let dir = cache_dir("evict");
+        // room for two images of 10 bytes and their checksums
+        let cache = RenderCache::new(&dir, 30);
+
+        cache.put(&key("a"), &[1; 10]).unwrap();
+        cache.put(&key("b"), &[2; 10]).unwrap();
+        set_age(&dir, &key("a"), Duration::from_secs(7200));
+        set_age(&dir, &key("b"), Duration::from_secs(3600));
+
+        // `a` is used again, so `b` is the least recently used one
+        assert!(cache.get(&key("a")).is_some());
+        cache.put(&key("c"), &[3; 10]).unwrap();
+
+        assert_eq!(cache.get(&key("a")), Some(vec![1; 10]));
+        assert_eq!(cache.get(&key("b")), None);
+        assert_eq!(cache.get(&key("c")), Some(vec![3; 10]));
+
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn stale_temporary_files() {
+        let dir = cache_dir("temporary");
+        let cache = RenderCache::new(&dir, 30);
+
+        fs::create_dir_all(&dir).unwrap();
+        let stale = dir.join("stale.1.0.tmp");
+        let fresh = dir.join("fresh.1.1.tmp");
+        fs::write(&stale, &[0; 10]).unwrap();
+        fs::write(&fresh, &[0; 10]).unwrap();
+        let file = OpenOptions::new().write(true).open(&stale).unwrap();
+        file.set_modified(SystemTime::now() - Duration::from_secs(3600))
+            .unwrap();
+
+        // the file being written counts in the size of the cache
+        cache.put(&key("a"), &[1; 10]).unwrap();
+        set_age(&dir, &key("a"), Duration::from_secs(3600));
+        cache.put(&key("b"), &[2; 10]).unwrap();
+        assert!(!stale.exists());
+        assert!(fresh.exists());
+        assert_eq!(cache.get(&key("a")), None);
+        assert_eq!(cache.get(&key("b")), Some(vec![2; 10]));
+
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn damaged_image() {
+        let dir = cache_dir("damaged");
+        let cache = RenderCache::new(&dir, 1 << 20);
+
+        cache.put(&key("a"), b"image a").unwrap();
+        let path = dir.join(key("a").file_name());
+        let mut data = fs::read(&path).unwrap();
+        data[2] ^= 0xff;
+        fs::write(&path, &data).unwrap();
+        assert_eq!(cache.get(&key("a")), None);
+        assert!(!path.exists());
+
+        // shorter than a checksum
+        cache.put(&key("b"), b"image b").unwrap();
+        fs::write(dir.join(key("b").file_name()), b"ab").unwrap();
+        assert_eq!(cache.get(&key("b")), None);
+
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
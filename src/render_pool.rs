@@ -0,0 +1,222 @@
+//! Render on a dedicated pool of threads, for async servers
+//!
+//! [`RenderPool::render`] returns a future which resolves to the PNG image once it is
+//! highlighted, drawn and encoded on one of the threads of the pool, so the threads of the
+//! executor never block on a render. It doesn't depend on an executor.
+//!
+//! At most `max_pending` renders are queued or running at once, the others are refused at
+//! once with [`RenderError::Busy`]. Dropping the future cancels its render, which stops
+//! before its next line if it is being highlighted, or before it is drawn. A render which
+//! is being drawn or encoded runs to the end. A render which panics resolves to
+//! [`RenderError::Panicked`].
+use crate::error::RenderError;
+use crate::formatter::{ImageFormatter, RenderContext};
+use rayon::{ThreadPool, ThreadPoolBuildError, ThreadPoolBuilder};
+use std::cell::RefCell;
+use std::future::Future;
+use std::panic::{self, AssertUnwindSafe};
+use std::pin::Pin;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, MutexGuard, PoisonError};
+use std::task::{Context, Poll, Waker};
+use syntect::easy::HighlightLines;
+use syntect::highlighting::Theme;
+use syntect::parsing::SyntaxSet;
+use syntect::util::LinesWithEndings;
+
+thread_local! {
+    /// buffers reused by the renders of each thread of the pool
+    static CONTEXT: RefCell<RenderContext> = RefCell::new(RenderContext::new());
+}
+
+/// A formatter shared by the threads of a pool
+pub struct RenderPool {
+    formatter: Arc<ImageFormatter>,
+    ps: Arc<SyntaxSet>,
+    pool: ThreadPool,
+    pending: Arc<AtomicUsize>,
+    max_pending: usize,
+}
+
+impl RenderPool {
+    /// Create a pool of `threads` threads (0 means all cores), which accepts at most
+    /// `max_pending` renders at once
+    pub fn new(
+        formatter: ImageFormatter,
+        ps: Arc<SyntaxSet>,
+        threads: usize,
+        max_pending: usize,
+    ) -> Result<Self, ThreadPoolBuildError> {
+        let pool = ThreadPoolBuilder::new()
+            .num_threads(threads)
+            .thread_name(|i| format!("silicon-render-{}", i))
+            .build()?;
+        Ok(Self {
+            formatter: Arc::new(formatter),
+            ps,
+            pool,
+            pending: Arc::new(AtomicUsize::new(0)),
+            max_pending,
+        })
+    }
+
+    /// Number of renders queued or running
+    pub fn pending(&self) -> usize {
+        self.pending.load(Ordering::Relaxed)
+    }
+
+    /// Render the code, in the language given by its name or its extension, as a PNG image
+    pub fn render(
+        &self,
+        code: String,
+        language: &str,
+        theme: Arc<Theme>,
+    ) -> Result<Render, RenderError> {
+        let syntax = self
+            .ps
+            .find_syntax_by_token(language)
+            .ok_or_else(|| RenderError::UnknownLanguage(language.to_owned()))?;
+        // the index of the syntax is sent to the pool, the set is shared
+        let syntax = self
+            .ps
+            .syntaxes()
+            .iter()
+            .position(|s| std::ptr::eq(s, syntax))
+            .unwrap();
+
+        if self.pending.fetch_add(1, Ordering::SeqCst) >= self.max_pending {
+            self.pending.fetch_sub(1, Ordering::SeqCst);
+            return Err(RenderError::Busy);
+        }
+
+        let shared = Arc::new(Shared::default());
+        let job = {
+            let (formatter, ps) = (self.formatter.clone(), self.ps.clone());
+            let guard = Job {
+                pending: self.pending.clone(),
+                shared: shared.clone(),
+            };
+            move || {
+                let shared = &guard.shared;
+                let image = panic::catch_unwind(AssertUnwindSafe(|| {
+                    render(&formatter, &ps, syntax, &code, &theme, shared)
+                }));
+                match image {
+                    Ok(Some(image)) => shared.complete(image),
+                    Ok(None) => shared.state().done = true,
+                    Err(_) => shared.complete(Err(RenderError::Panicked)),
+                }
+            }
+        };
+        self.pool.spawn(job);
+
+        Ok(Render { shared })
+    }
+}
+
+/// Highlight and render the code, `None` if it is cancelled
+fn render(
+    formatter: &ImageFormatter,
+    ps: &SyntaxSet,
+    syntax: usize,
+    code: &str,
+    theme: &Theme,
+    shared: &Shared,
+) -> Option<Result<Vec<u8>, RenderError>> {
+    let mut h = HighlightLines::new(&ps.syntaxes()[syntax], theme);
+    let mut lines = vec![];
+    for line in LinesWithEndings::from(code) {
+        if shared.is_cancelled() {
+            return None;
+        }
+        lines.push(h.highlight(line, ps));
+    }
+    if shared.is_cancelled() {
+        return None;
+    }
+
+    // the context is taken out of the thread while the image is drawn: rayon may run
+    // another render on this thread while it waits for the bands
+    let mut context = CONTEXT.with(|context| context.take());
+    let image = formatter.format_png_with(&lines, theme, &mut context, vec![]);
+    CONTEXT.with(|c| c.replace(context));
+    Some(image.map_err(RenderError::Io))
+}
+
+/// A job sent to the pool, which is always counted out of the pending renders and completed
+/// once it finishes, even if it panics
+struct Job {
+    pending: Arc<AtomicUsize>,
+    shared: Arc<Shared>,
+}
+
+impl Drop for Job {
+    fn drop(&mut self) {
+        if !self.shared.state().done {
+            self.shared.complete(Err(RenderError::Panicked));
+        }
+        self.pending.fetch_sub(1, Ordering::SeqCst);
+    }
+}
+
+#[derive(Default)]
+struct Shared {
+    state: Mutex<State>,
+    cancelled: AtomicBool,
+}
+
+#[derive(Default)]
+struct State {
+    image: Option<Result<Vec<u8>, RenderError>>,
+    waker: Option<Waker>,
+    /// the render finished, or was cancelled
+    done: bool,
+}
+
+impl Shared {
+    fn state(&self) -> MutexGuard<'_, State> {
+        self.state.lock().unwrap_or_else(PoisonError::into_inner)
+    }
+
+    fn is_cancelled(&self) -> bool {
+        self.cancelled.load(Ordering::Relaxed)
+    }
+
+    fn complete(&self, image: Result<Vec<u8>, RenderError>) {
+        let waker = {
+            let mut state = self.state();
+            state.image = Some(image);
+            state.done = true;
+            state.waker.take()
+        };
+        if let Some(waker) = waker {
+            waker.wake();
+        }
+    }
+}
+
+/// The future of a render, which is cancelled when it is dropped
+pub struct Render {
+    shared: Arc<Shared>,
+}
+
+impl Future for Render {
+    type Output = Result<Vec<u8>, RenderError>;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let mut state = self.shared.state();
+        match state.image.take() {
+            Some(image) => Poll::Ready(image),
+            None => {
+                state.waker = Some(cx.waker().clone());
+                Poll::Pending
+            }
+        }
+    }
+}
+
+impl Drop for Render {
+    fn drop(&mut self) {
+        self.shared.cancelled.store(true, Ordering::Relaxed);
+    }
+}
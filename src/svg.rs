@@ -0,0 +1,159 @@
+//! Pieces of the SVG images written by `ImageFormatter::format_svg`
+use crate::utils::WINDOW_CONTROLS;
+use image::Rgba;
+use std::fmt::Write;
+
+/// The fill attributes of an element of the color
+pub(crate) fn fill(color: Rgba<u8>) -> String {
+    let [r, g, b, a] = color.0;
+    let mut fill = format!(r##"fill="#{:02x}{:02x}{:02x}""##, r, g, b);
+    if a != 255 {
+        write!(fill, r#" fill-opacity="{:.3}""#, f32::from(a) / 255.0).unwrap();
+    }
+    fill
+}
+
+/// Escape the text for the content or an attribute of an element.
+///
+/// Carriage returns (of CRLF line endings) are dropped, and the characters which are not
+/// allowed in XML are replaced by U+FFFD.
+pub(crate) fn escape(text: &str) -> String {
+    let mut escaped = String::with_capacity(text.len());
+    for c in text.chars() {
+        match c {
+            '&' => escaped.push_str("&amp;"),
+            '<' => escaped.push_str("&lt;"),
+            '>' => escaped.push_str("&gt;"),
+            '"' => escaped.push_str("&quot;"),
+            '\t' | '\n' => escaped.push(c),
+            '\r' => (),
+            '\u{0}'..='\u{1f}' | '\u{fffe}' | '\u{ffff}' => escaped.push('\u{fffd}'),
+            _ => escaped.push(c),
+        }
+    }
+    escaped
+}
+
+/// Encode the data in base64, for a data URL
+pub(crate) fn base64(data: &[u8]) -> String {
+    const TABLE: &[u8; 64] = b"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    let mut encoded = String::with_capacity((data.len() + 2) / 3 * 4);
+    for chunk in data.chunks(3) {
+        let n = chunk
+            .iter()
+            .enumerate()
+            .fold(0u32, |n, (i, &byte)| n | u32::from(byte) << (16 - 8 * i));
+        for i in 0..4 {
+            if i <= chunk.len() {
+                encoded.push(TABLE[(n >> (18 - 6 * i) & 0x3f) as usize] as char);
+            } else {
+                encoded.push('=');
+            }
+        }
+    }
+    encoded
+}
+
+/// The window controls of a code image whose top left corner is at (x, y)
+pub(crate) fn window_controls(x: u32, y: u32) -> String {
+    let mut controls = String::new();
+    for (i, (fill, outline)) in WINDOW_CONTROLS.iter().enumerate() {
+        let (cx, cy) = (x + 35 + i as u32 * 40, y + 35);
+        writeln!(
+            controls,
+            r#"<circle cx="{}" cy="{}" r="10.5" fill="{}" stroke="{}"/>"#,
+            cx, cy, fill, outline
+        )
+        .unwrap();
+    }
+    controls
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{base64, escape};
+    use crate::formatter::ImageFormatterBuilder;
+    use crate::utils::{init_syntect, ShadowAdder};
+    use syntect::easy::HighlightLines;
+    use syntect::util::LinesWithEndings;
+
+    fn render(code: &str) -> String {
+        let (ps, ts) = init_syntect();
+        let syntax = ps.find_syntax_by_token("rs").unwrap();
+        let theme = &ts.themes["Dracula"];
+        let mut h = HighlightLines::new(syntax, theme);
+        let lines = LinesWithEndings::from(code)
+            .map(|line| h.highlight(line, &ps))
+            .collect::<Vec<_>>();
+
+        let formatter = ImageFormatterBuilder::<String>::new()
+            .shadow_adder(ShadowAdder::new())
+            .build()
+            .unwrap();
+        let doc = formatter.format_svg(&lines, theme, vec![]).unwrap();
+        String::from_utf8(doc).unwrap()
+    }
+
+    /// Check that the document is well-formed, as far as the documents of `format_svg` go:
+    /// only characters and references allowed in XML, quoted attributes, matching tags
+    fn assert_well_formed(doc: &str) {
+        let invalid = doc.chars().find(|&c| match c {
+            '\t' | '\n' | ' '..='\u{d7ff}' | '\u{e000}'..='\u{fffd}' => false,
+            c => c < '\u{10000}',
+        });
+        assert_eq!(invalid, None);
+
+        let mut open = vec![];
+        let mut rest = doc;
+        while let Some(start) = rest.find(|c: char| c == '<' || c == '&') {
+            rest = &rest[start..];
+            let end = rest.find(if rest.starts_with('&') { ';' } else { '>' });
+            let end = end.expect("unterminated tag or reference");
+            let (item, next) = (&rest[1..end], &rest[end + 1..]);
+
+            if rest.starts_with('&') {
+                assert!(["amp", "lt", "gt", "quot"].contains(&item), "&{};", item);
+            } else if let Some(name) = item.strip_prefix('/') {
+                assert_eq!(open.pop(), Some(name));
+            } else {
+                assert_eq!(item.matches('"').count() % 2, 0, "<{}>", item);
+                if !item.ends_with('/') {
+                    open.push(item.split_whitespace().next().unwrap());
+                }
+            }
+            rest = next;
+        }
+        assert!(open.is_empty(), "unclosed {:?}", open);
+    }
+
+    #[test]
+    fn escape_invalid_characters() {
+        assert_eq!(
+            escape("a < b && c > \"d\""),
+            "a &lt; b &amp;&amp; c &gt; &quot;d&quot;"
+        );
+        assert_eq!(escape("line\r\n\tx"), "line\n\tx");
+        assert_eq!(escape("\u{0}\u{7}\u{1b}[0m"), "\u{fffd}\u{fffd}\u{fffd}[0m");
+    }
+
+    #[test]
+    fn svg_is_well_formed() {
+        let crlf = render("fn main() {\r\n    println!(\"<&>\");\r\n}\r\n");
+        assert!(crlf.contains("main"));
+        assert_well_formed(&crlf);
+
+        let control = render("let bell = \"\u{7}\";\nlet escape = '\u{1b}';\n");
+        assert!(control.contains('\u{fffd}'));
+        assert_well_formed(&control);
+    }
+
+    #[test]
+    fn base64_padding() {
+        assert_eq!(base64(b""), "");
+        assert_eq!(base64(b"f"), "Zg==");
+        assert_eq!(base64(b"fo"), "Zm8=");
+        assert_eq!(base64(b"foo"), "Zm9v");
+        assert_eq!(base64(b"foobar"), "Zm9vYmFy");
+    }
+}
@@ -1,25 +1,38 @@
+use crate::blur::{blur_profile, gaussian_blur_with};
 use crate::directories::PROJECT_DIRS;
 use crate::error::ParseColorError;
-use image::imageops::{crop, resize, FilterType};
+use image::imageops::{crop_imm, resize, FilterType};
 use image::Pixel;
-use image::{DynamicImage, GenericImage, GenericImageView, Rgba, RgbaImage};
+use image::{DynamicImage, GenericImage, GenericImageView, ImageBuffer, Rgba, RgbaImage};
 use imageproc::drawing::{draw_filled_rect_mut, draw_line_segment_mut};
 use imageproc::rect::Rect;
+use lazy_static::lazy_static;
+use rayon::prelude::*;
+use std::collections::HashMap;
+use std::hash::Hash;
+use std::ops::{Deref, DerefMut};
+use std::path::PathBuf;
+use std::sync::{Arc, Mutex};
 use syntect::dumps;
 use syntect::highlighting::ThemeSet;
 use syntect::parsing::SyntaxSet;
 
+/// The path of a file of bat's cache, if it exists
+fn cache_file(name: &str) -> Option<PathBuf> {
+    let path = PROJECT_DIRS.cache_dir().join(name);
+    if path.exists() {
+        Some(path)
+    } else {
+        None
+    }
+}
+
 pub fn read_from_bat_cache() -> Option<(SyntaxSet, ThemeSet)> {
-    let cache_dir = PROJECT_DIRS.cache_dir();
-    let syntax_cache = cache_dir.join("syntaxes.bin");
-    let theme_cache = cache_dir.join("themes.bin");
-    if syntax_cache.exists() && theme_cache.exists() {
-        if let (Ok(a), Ok(b)) = (
-            dumps::from_dump_file(syntax_cache),
-            dumps::from_dump_file(theme_cache),
-        ) {
-            return Some((a, b));
-        }
+    if let (Ok(a), Ok(b)) = (
+        dumps::from_dump_file(cache_file("syntaxes.bin")?),
+        dumps::from_dump_file(cache_file("themes.bin")?),
+    ) {
+        return Some((a, b));
     }
     None
 }
@@ -27,12 +40,23 @@ pub fn read_from_bat_cache() -> Option<(SyntaxSet, ThemeSet)> {
 /// Load the default SyntaxSet and ThemeSet.
 pub fn init_syntect() -> (SyntaxSet, ThemeSet) {
     // try to use bat's cache
-    read_from_bat_cache().unwrap_or_else(|| {
-        (
-            dumps::from_binary(include_bytes!("../assets/syntaxes.bin")),
-            dumps::from_binary(include_bytes!("../assets/themes.bin")),
-        )
-    })
+    read_from_bat_cache().unwrap_or_else(|| (load_syntax_set(), load_theme_set()))
+}
+
+/// Load the default SyntaxSet only, from bat's cache if possible.
+///
+/// It's slower than loading the themes, so load it only when it is needed.
+pub fn load_syntax_set() -> SyntaxSet {
+    cache_file("syntaxes.bin")
+        .and_then(|path| dumps::from_dump_file(path).ok())
+        .unwrap_or_else(|| dumps::from_binary(include_bytes!("../assets/syntaxes.bin")))
+}
+
+/// Load the default ThemeSet only, from bat's cache if possible.
+pub fn load_theme_set() -> ThemeSet {
+    cache_file("themes.bin")
+        .and_then(|path| dumps::from_dump_file(path).ok())
+        .unwrap_or_else(|| dumps::from_binary(include_bytes!("../assets/themes.bin")))
 }
 
 pub trait ToRgba {
@@ -96,20 +120,71 @@ impl ToRgba for syntect::highlighting::Color {
     }
 }
 
-/// Add the window controls for image
-pub(crate) fn add_window_controls(image: &mut DynamicImage) {
-    let color = [
-        ("#FF5F56", "#E0443E"),
-        ("#FFBD2E", "#DEA123"),
-        ("#27C93F", "#1AAB29"),
-    ];
+/// Max number of sprites of each kind kept in memory
+const MAX_SPRITES: usize = 64;
+
+type SpriteCache<K> = Mutex<HashMap<K, Arc<RgbaImage>>>;
+
+lazy_static! {
+    /// title bars by background color
+    static ref TITLE_BARS: SpriteCache<[u8; 4]> = Mutex::new(HashMap::new());
+    /// corner circles by radius
+    static ref CORNERS: SpriteCache<u32> = Mutex::new(HashMap::new());
+}
+
+/// Get a sprite from the cache, or draw it the first time it is used
+fn get_sprite<K, F>(cache: &SpriteCache<K>, key: K, draw: F) -> Arc<RgbaImage>
+where
+    K: Eq + Hash,
+    F: FnOnce() -> RgbaImage,
+{
+    if let Some(sprite) = cache.lock().unwrap().get(&key) {
+        return sprite.clone();
+    }
+
+    // draw it without holding the lock
+    let sprite = Arc::new(draw());
+    let mut cache = cache.lock().unwrap();
+    if cache.len() >= MAX_SPRITES {
+        cache.clear();
+    }
+    cache.insert(key, sprite.clone());
+    sprite
+}
+
+/// Rows of an image, borrowed from its buffer
+pub(crate) type Rows<'a> = ImageBuffer<Rgba<u8>, &'a mut [u8]>;
 
-    let mut background = image.get_pixel(37, 37);
+/// Borrow the rows `y..y + height` of the image
+pub(crate) fn rows(image: &mut RgbaImage, y: u32, height: u32) -> Rows<'_> {
+    let width = image.width();
+    let stride = width as usize * 4;
+    let start = y as usize * stride;
+    let buffer: &mut [u8] = image;
+    let buffer = &mut buffer[start..start + height as usize * stride];
+    ImageBuffer::from_raw(width, height, buffer).unwrap()
+}
+
+/// Add the window controls for image, the code image whose top left corner is at (x, y)
+pub(crate) fn add_window_controls(image: &mut Rows<'_>, x: u32, y: u32, mut background: Rgba<u8>) {
     background.0[3] = 0;
 
+    // the edges of the circles are mixed with the background, so it is drawn for each one
+    let title_bar = get_sprite(&TITLE_BARS, background.0, || draw_title_bar(background));
+    copy_alpha(&title_bar, image, x + 15, y + 15);
+}
+
+/// Fill and outline colors of the window controls
+pub(crate) const WINDOW_CONTROLS: [(&str, &str); 3] = [
+    ("#FF5F56", "#E0443E"),
+    ("#FFBD2E", "#DEA123"),
+    ("#27C93F", "#1AAB29"),
+];
+
+fn draw_title_bar(background: Rgba<u8>) -> RgbaImage {
     let mut title_bar = RgbaImage::from_pixel(120 * 3, 40 * 3, background);
 
-    for (i, (fill, outline)) in color.iter().enumerate() {
+    for (i, (fill, outline)) in WINDOW_CONTROLS.iter().enumerate() {
         draw_filled_circle_mut(
             &mut title_bar,
             (((i * 40) as i32 + 20) * 3, 20 * 3),
@@ -125,9 +200,7 @@ pub(crate) fn add_window_controls(image: &mut DynamicImage) {
     }
     // create a big image and resize it to blur the edge
     // it looks better than `blur()`
-    let title_bar = resize(&title_bar, 120, 40, FilterType::Triangle);
-
-    copy_alpha(&title_bar, image.as_mut_rgba8().unwrap(), 15, 15);
+    resize(&title_bar, 120, 40, FilterType::Triangle)
 }
 
 #[derive(Clone, Debug)]
@@ -142,19 +215,108 @@ impl Default for Background {
     }
 }
 
-impl Background {
-    fn to_image(&self, width: u32, height: u32) -> RgbaImage {
-        match self {
-            Background::Solid(color) => RgbaImage::from_pixel(width, height, color.to_owned()),
-            Background::Image(image) => resize(image, width, height, FilterType::Triangle),
+/// How a background image fills the final image
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+pub enum BackgroundFit {
+    /// resized to the size of the final image
+    Stretch,
+    /// scaled to cover the final image, keeping its aspect ratio, and cropped at the center
+    Cover,
+    /// repeated from the top left corner, without scaling
+    Tile,
+}
+
+impl Default for BackgroundFit {
+    fn default() -> Self {
+        Self::Stretch
+    }
+}
+
+/// Max number of scaled background images kept by a `ShadowAdder`
+const MAX_SCALED_BACKGROUNDS: usize = 4;
+
+/// The last scaled versions of the background image, by size
+#[derive(Default)]
+struct ScaledBackgrounds(Mutex<Vec<((u32, u32), Arc<RgbaImage>)>>);
+
+impl std::fmt::Debug for ScaledBackgrounds {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        let sizes = self
+            .0
+            .lock()
+            .unwrap()
+            .iter()
+            .map(|(size, _)| *size)
+            .collect::<Vec<_>>();
+        f.debug_tuple("ScaledBackgrounds").field(&sizes).finish()
+    }
+}
+
+impl ScaledBackgrounds {
+    /// The image resized to the size, resizing it only if it isn't one of the last sizes
+    fn get(&self, image: &RgbaImage, width: u32, height: u32) -> Arc<RgbaImage> {
+        let size = (width, height);
+        {
+            let mut scaled = self.0.lock().unwrap();
+            if let Some(i) = scaled.iter().position(|(s, _)| *s == size) {
+                // the most recently used at the end
+                let entry = scaled.remove(i);
+                let found = entry.1.clone();
+                scaled.push(entry);
+                return found;
+            }
+        }
+
+        // resize it without holding the lock
+        let image = Arc::new(resize(image, width, height, FilterType::Triangle));
+        let mut scaled = self.0.lock().unwrap();
+        if scaled.len() >= MAX_SCALED_BACKGROUNDS {
+            scaled.remove(0);
+        }
+        scaled.push((size, image.clone()));
+        image
+    }
+}
+
+/// The size to which an image is scaled to cover an area.
+///
+/// The scale is rounded up to a step of 1/8 octave, so the areas of similar sizes (such
+/// as snippets with a few more lines) are cropped from the same scaled image.
+fn cover_size(image: (u32, u32), area: (u32, u32)) -> (u32, u32) {
+    let scale_x = f64::from(area.0) / f64::from(image.0.max(1));
+    let scale_y = f64::from(area.1) / f64::from(image.1.max(1));
+    let scale = 2f64.powf((scale_x.max(scale_y).log2() * 8.0).ceil() / 8.0);
+    (
+        ((f64::from(image.0) * scale).ceil() as u32).max(area.0),
+        ((f64::from(image.1) * scale).ceil() as u32).max(area.1),
+    )
+}
+
+/// Repeat the image to fill an image of the given size
+fn tile(image: &RgbaImage, width: u32, height: u32) -> RgbaImage {
+    let mut tiled = RgbaImage::new(width, height);
+    if image.width() == 0 || image.height() == 0 {
+        return tiled;
+    }
+
+    let row = image.width() as usize * 4;
+    let tiled_row = width as usize * 4;
+    let tiled_raw: &mut [u8] = &mut tiled;
+    for (y, dst) in tiled_raw.chunks_exact_mut(tiled_row.max(1)).enumerate() {
+        let src = &image.as_raw()[(y % image.height() as usize) * row..][..row];
+        for chunk in dst.chunks_mut(row) {
+            chunk.copy_from_slice(&src[..chunk.len()]);
         }
     }
+    tiled
 }
 
 /// Add the shadow for image
 #[derive(Debug)]
 pub struct ShadowAdder {
     background: Background,
+    background_fit: BackgroundFit,
+    scaled_backgrounds: ScaledBackgrounds,
     shadow_color: Rgba<u8>,
     blur_radius: f32,
     pad_horiz: u32,
@@ -167,6 +329,8 @@ impl ShadowAdder {
     pub fn new() -> Self {
         Self {
             background: Background::default(),
+            background_fit: BackgroundFit::default(),
+            scaled_backgrounds: ScaledBackgrounds::default(),
             shadow_color: "#707070".to_rgba().unwrap(),
             blur_radius: 50.0,
             pad_horiz: 80,
@@ -182,6 +346,12 @@ impl ShadowAdder {
         self
     }
 
+    /// Set how the background image fills the image
+    pub fn background_fit(mut self, fit: BackgroundFit) -> Self {
+        self.background_fit = fit;
+        self
+    }
+
     /// Set the shadow color
     pub fn shadow_color(mut self, color: Rgba<u8>) -> Self {
         self.shadow_color = color;
@@ -216,35 +386,133 @@ impl ShadowAdder {
 
     pub fn apply_to(&self, image: &DynamicImage) -> DynamicImage {
         // the size of the final image
-        let width = image.width() + self.pad_horiz * 2;
-        let height = image.height() + self.pad_vert * 2;
+        let (width, height) = self.size_for(image.width(), image.height());
+
+        let mut shadow = self.background_image(width, height);
+        self.draw_to(image.as_rgba8().unwrap(), &mut shadow);
+
+        DynamicImage::ImageRgba8(shadow)
+    }
 
-        // create the shadow
-        let mut shadow = self.background.to_image(width, height);
-        if self.blur_radius > 0.0 {
+    /// Draw the shadow and the image to the background of the final image
+    pub(crate) fn draw_to(&self, image: &RgbaImage, shadow: &mut RgbaImage) {
+        self.draw_shadow(shadow, image.width(), image.height(), true);
+
+        // copy the original image to the top of it
+        copy_alpha(image, shadow, self.pad_horiz, self.pad_vert);
+    }
+
+    /// Draw the shadow of an image of the given size to the background of the final image,
+    /// on the current thread only if `parallel` is false
+    pub(crate) fn draw_shadow(
+        &self,
+        shadow: &mut RgbaImage,
+        width: u32,
+        height: u32,
+        parallel: bool,
+    ) {
+        if self.blur_radius > 0.0 && self.solid_background().is_none() {
+            // a background image is blurred together with the shadow
             let rect = Rect::at(
                 self.pad_horiz as i32 + self.offset_x,
                 self.pad_vert as i32 + self.offset_y,
             )
-            .of_size(image.width(), image.height());
+            .of_size(width, height);
+            draw_filled_rect_mut(shadow, rect, self.shadow_color);
 
-            draw_filled_rect_mut(&mut shadow, rect, self.shadow_color);
+            let image = std::mem::replace(shadow, RgbaImage::new(0, 0));
+            *shadow = gaussian_blur_with(image, self.blur_radius, parallel);
+            return;
+        }
 
-            shadow = crate::blur::gaussian_blur(shadow, self.blur_radius);
+        if let Some(profile) = self.shadow_profile(width, height) {
+            self.draw_shadow_band(shadow, 0, &profile, parallel);
         }
-        // it's to slow!
-        // shadow = blur(&shadow, self.blur_radius);
+    }
 
-        // copy the original image to the top of it
-        copy_alpha(
-            image.as_rgba8().unwrap(),
-            &mut shadow,
-            self.pad_horiz,
-            self.pad_vert,
-        );
+    /// The background of the final image, of the given size
+    pub(crate) fn background_image(&self, width: u32, height: u32) -> RgbaImage {
+        let image = match &self.background {
+            Background::Solid(color) => return RgbaImage::from_pixel(width, height, *color),
+            Background::Image(image) => image,
+        };
+
+        match self.background_fit {
+            BackgroundFit::Stretch => (*self.scaled_backgrounds.get(image, width, height)).clone(),
+            BackgroundFit::Cover => {
+                let (scaled_width, scaled_height) = cover_size(image.dimensions(), (width, height));
+                let scaled = self
+                    .scaled_backgrounds
+                    .get(image, scaled_width, scaled_height);
+                let (x, y) = ((scaled_width - width) / 2, (scaled_height - height) / 2);
+                crop_imm(&*scaled, x, y, width, height).to_image()
+            }
+            BackgroundFit::Tile => tile(image, width, height),
+        }
+    }
 
-        DynamicImage::ImageRgba8(shadow)
+    /// The size of the final image, for an image of the given size
+    pub(crate) fn size_for(&self, width: u32, height: u32) -> (u32, u32) {
+        (width + self.pad_horiz * 2, height + self.pad_vert * 2)
+    }
+
+    /// Where the original image is placed in the final image
+    pub(crate) fn offset(&self) -> (u32, u32) {
+        (self.pad_horiz, self.pad_vert)
+    }
+
+    /// The color, the blur radius and the offset of the shadow
+    pub(crate) fn shadow(&self) -> (Rgba<u8>, f32, (i32, i32)) {
+        (
+            self.shadow_color,
+            self.blur_radius,
+            (self.offset_x, self.offset_y),
+        )
+    }
+
+    /// The color of the background, if it's not an image
+    pub(crate) fn solid_background(&self) -> Option<Rgba<u8>> {
+        match self.background {
+            Background::Solid(color) => Some(color),
+            Background::Image(_) => None,
+        }
+    }
+
+    /// The shadow of an image of the given size over a solid background, `None` if it's
+    /// not blurred
+    pub(crate) fn shadow_profile(&self, width: u32, height: u32) -> Option<ShadowProfile> {
+        if self.blur_radius <= 0.0 {
+            return None;
+        }
+
+        // blurring the rectangle is the same as blending the shadow color
+        // weighted by the blurred profiles of its two sides
+        let (size_x, size_y) = self.size_for(width, height);
+        let x = i64::from(self.pad_horiz) + i64::from(self.offset_x);
+        let y = i64::from(self.pad_vert) + i64::from(self.offset_y);
+        Some(ShadowProfile {
+            horiz: blur_profile(size_x as usize, x, x + i64::from(width), self.blur_radius),
+            vert: blur_profile(size_y as usize, y, y + i64::from(height), self.blur_radius),
+        })
     }
+
+    /// Draw the shadow to the band of the final image which starts at the row `top`
+    pub(crate) fn draw_shadow_band(
+        &self,
+        band: &mut RgbaImage,
+        top: u32,
+        profile: &ShadowProfile,
+        parallel: bool,
+    ) {
+        let vert = &profile.vert[top as usize..(top + band.height()) as usize];
+        draw_shadow(band, &profile.horiz, vert, self.shadow_color, parallel);
+    }
+}
+
+/// The blurred profiles of the two sides of a shadow
+pub(crate) struct ShadowProfile {
+    horiz: Vec<f32>,
+    vert: Vec<f32>,
 }
 
 impl Default for ShadowAdder {
@@ -253,61 +521,191 @@ impl Default for ShadowAdder {
     }
 }
 
-/// copy from src to dst, taking into account alpha channels
-pub(crate) fn copy_alpha(src: &RgbaImage, dst: &mut RgbaImage, x: u32, y: u32) {
-    assert!(src.width() + x <= dst.width());
-    assert!(src.height() + y <= dst.height());
-    for j in 0..src.height() {
-        for i in 0..src.width() {
-            // NOTE: Undeprecate in https://github.com/image-rs/image/pull/1008
-            #[allow(deprecated)]
-            unsafe {
-                let s = src.unsafe_get_pixel(i, j);
-                let mut d = dst.unsafe_get_pixel(i + x, j + y);
-                match s.0[3] {
-                    255 => d = s,
-                    0 => (/* do nothing */),
-                    _ => d.blend(&s),
+/// Blend `color` to the image, weighted by `horiz[x] * vert[y]`
+fn draw_shadow(
+    image: &mut RgbaImage,
+    horiz: &[f32],
+    vert: &[f32],
+    color: Rgba<u8>,
+    parallel: bool,
+) {
+    // the shadow is only visible where both profiles are positive
+    let left = match horiz.iter().position(|&v| v > 0.0) {
+        Some(left) => left,
+        None => return,
+    };
+    let right = horiz.iter().rposition(|&v| v > 0.0).unwrap() + 1;
+    let horiz = &horiz[left..right];
+
+    let stride = image.width() as usize * 4;
+    let color = u32::from_ne_bytes(color.0);
+
+    let draw_row = |(row, &v): (&mut [u8], &f32)| {
+        if v <= 0.0 {
+            return;
+        }
+        let row = &mut row[left * 4..right * 4];
+        for (pixel, &h) in row.chunks_exact_mut(4).zip(horiz) {
+            match (h * v * 255.0).round() as u8 {
+                0 => (),
+                255 => pixel.copy_from_slice(&color.to_ne_bytes()),
+                alpha => {
+                    let d = u32::from_ne_bytes([pixel[0], pixel[1], pixel[2], pixel[3]]);
+                    pixel.copy_from_slice(&lerp_pixel(d, color, alpha).to_ne_bytes());
                 }
-                dst.unsafe_put_pixel(i + x, j + y, d);
             }
         }
+    };
+
+    if parallel {
+        image
+            .par_chunks_mut(stride)
+            .zip(vert.par_iter())
+            .for_each(draw_row);
+    } else {
+        image.chunks_mut(stride).zip(vert).for_each(draw_row);
     }
 }
 
-/// Round the corner of the image
-pub(crate) fn round_corner(image: &mut DynamicImage, radius: u32) {
-    // draw a circle with given foreground on given background
-    // then split it into four pieces and paste them to the four corner of the image
-    let mut circle =
-        RgbaImage::from_pixel(radius * 2 + 1, radius * 2 + 1, Rgba([255, 255, 255, 0]));
+/// copy from src to dst, taking into account alpha channels
+pub(crate) fn copy_alpha<C>(src: &RgbaImage, dst: &mut ImageBuffer<Rgba<u8>, C>, x: u32, y: u32)
+where
+    C: Deref<Target = [u8]> + DerefMut,
+{
+    assert!(src.width() + x <= dst.width());
+    assert!(src.height() + y <= dst.height());
+    if src.width() == 0 {
+        return;
+    }
 
-    let width = image.width();
-    let height = image.height();
+    let row = src.width() as usize * 4;
+    let stride = dst.width() as usize * 4;
+    let offset = y as usize * stride + x as usize * 4;
+    let dst: &mut [u8] = dst;
+    for (j, src_row) in src.chunks_exact(row).enumerate() {
+        let start = offset + j * stride;
+        copy_alpha_row(src_row, &mut dst[start..start + row]);
+    }
+}
 
-    let foreground = image.get_pixel(width - 1, height - 1);
+/// Blend the color over the rectangle of the given size at (x, y) of the image
+pub(crate) fn fill_alpha(
+    image: &mut Rows<'_>,
+    (x, y): (u32, u32),
+    size: (u32, u32),
+    color: Rgba<u8>,
+) {
+    if image.width() == 0 {
+        return;
+    }
 
-    // TODO: need a blur on edge
-    draw_filled_circle_mut(
-        &mut circle,
-        (radius as i32, radius as i32),
-        radius as i32,
-        foreground,
-    );
+    let row = color.0.repeat(size.0 as usize);
+    let stride = image.width() as usize * 4;
+    let dst: &mut [u8] = image;
+    for j in y..y + size.1 {
+        let start = j as usize * stride + x as usize * 4;
+        copy_alpha_row(&row, &mut dst[start..start + row.len()]);
+    }
+}
 
-    let part = crop(&mut circle, 0, 0, radius, radius);
-    image.copy_from(&part, 0, 0).unwrap();
+/// Composite a row over another one, span by span: the opaque pixels are copied, the
+/// transparent ones are skipped and only the others are blended.
+///
+/// The blended pixels are done one at a time, without SIMD intrinsics. They are few, the
+/// opaque spans which make most of an image are copied with `copy_from_slice`.
+fn copy_alpha_row(src: &[u8], dst: &mut [u8]) {
+    let kind = |alpha: u8| match alpha {
+        0 => 0,
+        255 => 2,
+        _ => 1,
+    };
+
+    let pixels = src.len() / 4;
+    let mut start = 0;
+    while start < pixels {
+        let span = kind(src[start * 4 + 3]);
+        let end = (start + 1..pixels)
+            .find(|&i| kind(src[i * 4 + 3]) != span)
+            .unwrap_or(pixels);
+        let (src, dst) = (&src[start * 4..end * 4], &mut dst[start * 4..end * 4]);
+
+        match span {
+            2 => dst.copy_from_slice(src),
+            1 => {
+                for (s, d) in src.chunks_exact(4).zip(dst.chunks_exact_mut(4)) {
+                    blend_pixel(s, d);
+                }
+            }
+            _ => (/* do nothing */),
+        }
+        start = end;
+    }
+}
 
-    let part = crop(&mut circle, radius + 1, 0, radius, radius);
-    image.copy_from(&part, width - radius, 0).unwrap();
+fn blend_pixel(src: &[u8], dst: &mut [u8]) {
+    if dst[3] == 255 {
+        // over an opaque pixel it is just an interpolation of the colors
+        let s = u32::from_ne_bytes([src[0], src[1], src[2], src[3]]);
+        let d = u32::from_ne_bytes([dst[0], dst[1], dst[2], dst[3]]);
+        let mut pixel = lerp_pixel(d, s, src[3]).to_ne_bytes();
+        pixel[3] = 255;
+        dst.copy_from_slice(&pixel);
+    } else {
+        let mut d = Rgba([dst[0], dst[1], dst[2], dst[3]]);
+        d.blend(&Rgba([src[0], src[1], src[2], src[3]]));
+        dst.copy_from_slice(&d.0);
+    }
+}
 
-    let part = crop(&mut circle, 0, radius + 1, radius, radius);
-    image.copy_from(&part, 0, height - radius).unwrap();
+/// Linear interpolation of the four channels of two packed RGBA pixels:
+/// `(src * alpha + dst * (255 - alpha)) / 255`, rounded.
+///
+/// Two channels are computed in each half of a u32 at once. This is plain integer math
+/// rather than SIMD intrinsics, so it is the same on every target.
+#[inline]
+pub(crate) fn lerp_pixel(dst: u32, src: u32, alpha: u8) -> u32 {
+    const MASK: u32 = 0x00ff_00ff;
+    let a = u32::from(alpha);
+    let ia = 255 - a;
+    let rb = (dst & MASK) * ia + (src & MASK) * a + 0x0080_0080;
+    let ga = ((dst >> 8) & MASK) * ia + ((src >> 8) & MASK) * a + 0x0080_0080;
+    // x / 255 == (x + x / 256) / 256 after adding the rounding bias
+    let rb = ((rb + ((rb >> 8) & MASK)) >> 8) & MASK;
+    let ga = (ga + ((ga >> 8) & MASK)) & !MASK;
+    rb | ga
+}
 
-    let part = crop(&mut circle, radius + 1, radius + 1, radius, radius);
-    image
-        .copy_from(&part, width - radius, height - radius)
-        .unwrap();
+/// The pixels cut out of each row by round corners of the given radius: the number of
+/// pixels at the left and at the right of the rows at the top, then of the rows at the
+/// bottom.
+pub(crate) fn corner_insets(radius: u32) -> (Vec<(u32, u32)>, Vec<(u32, u32)>) {
+    // draw a circle, then split it into four pieces for the four corners of the image
+    let circle = get_sprite(&CORNERS, radius, || {
+        let mut circle =
+            RgbaImage::from_pixel(radius * 2 + 1, radius * 2 + 1, Rgba([255, 255, 255, 0]));
+        // TODO: need a blur on edge
+        draw_filled_circle_mut(
+            &mut circle,
+            (radius as i32, radius as i32),
+            radius as i32,
+            Rgba([0, 0, 0, 255]),
+        );
+        circle
+    });
+
+    let transparent = |x, y| circle.get_pixel(x, y).0[3] == 0;
+    let insets = |y| {
+        let left = (0..radius).take_while(|&x| transparent(x, y)).count();
+        let right = (radius + 1..radius * 2 + 1)
+            .rev()
+            .take_while(|&x| transparent(x, y))
+            .count();
+        (left as u32, right as u32)
+    };
+    (
+        (0..radius).map(insets).collect(),
+        (radius + 1..radius * 2 + 1).map(insets).collect(),
+    )
 }
 
 // `draw_filled_circle_mut` doesn't work well with small radius in imageproc v0.18.0
@@ -368,8 +766,8 @@ pub(crate) fn draw_filled_circle_mut<I>(
 
 #[cfg(test)]
 mod tests {
-    use crate::utils::ToRgba;
-    use image::Rgba;
+    use crate::utils::{copy_alpha, lerp_pixel, ToRgba};
+    use image::{Pixel, Rgba, RgbaImage};
 
     #[test]
     fn to_rgba() {
@@ -378,4 +776,58 @@ mod tests {
         assert_eq!("#abc".to_rgba(), Ok(Rgba([0xaa, 0xbb, 0xcc, 0xff])));
         assert_eq!("#abcd".to_rgba(), Ok(Rgba([0xaa, 0xbb, 0xcc, 0xdd])));
     }
+
+    #[test]
+    fn lerp() {
+        // every alpha, and channels which cover both ends of the range
+        let values = (0..=255u32).step_by(3).collect::<Vec<_>>();
+        for alpha in 0..=255u32 {
+            for &d in &values {
+                for &s in &values {
+                    let [d8, s8] = [d as u8, s as u8];
+                    let dst = u32::from_ne_bytes([d8, s8, d8, s8]);
+                    let src = u32::from_ne_bytes([s8, d8, s8, d8]);
+                    let result = lerp_pixel(dst, src, alpha as u8).to_ne_bytes();
+
+                    let lerp = |d, s| ((s * alpha + d * (255 - alpha) + 127) / 255) as u8;
+                    let (a, b) = (lerp(d, s), lerp(s, d));
+                    assert_eq!(result, [a, b, a, b], "{} {} {}", alpha, d, s);
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn copy_alpha_spans() {
+        let alphas = [255u8, 255, 0, 0, 128, 255, 1, 0];
+        let src = RgbaImage::from_fn(8, 2, |x, _| Rgba([200, 100, 50, alphas[x as usize]]));
+        let mut dst = RgbaImage::from_fn(10, 4, |x, y| Rgba([10, 20, 30, 255 - (x * y) as u8]));
+        let mut expected = dst.clone();
+        for (x, y, pixel) in src.enumerate_pixels() {
+            expected.get_pixel_mut(x + 1, y + 2).blend(pixel);
+        }
+
+        copy_alpha(&src, &mut dst, 1, 2);
+        for (d, e) in dst.pixels().zip(expected.pixels()) {
+            // interpolating the colors doesn't round like `blend`
+            for (&d, &e) in d.0.iter().zip(&e.0) {
+                assert!((i32::from(d) - i32::from(e)).abs() <= 1, "{:?} {:?}", d, e);
+            }
+        }
+    }
+
+    #[test]
+    fn copy_alpha_opaque() {
+        // every alpha, over an opaque row
+        let src = RgbaImage::from_fn(256, 1, |x, _| Rgba([200, 100, 50, x as u8]));
+        let mut dst = RgbaImage::from_pixel(256, 1, Rgba([10, 20, 255, 255]));
+
+        copy_alpha(&src, &mut dst, 0, 0);
+        for (x, pixel) in dst.pixels().enumerate() {
+            let a = x as u32;
+            let lerp = |s: u32, d: u32| ((s * a + d * (255 - a) + 127) / 255) as u8;
+            let expected = [lerp(200, 10), lerp(100, 20), lerp(50, 255), 255];
+            assert_eq!(pixel.0, expected, "alpha {}", a);
+        }
+    }
 }